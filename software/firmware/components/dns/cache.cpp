@@ -0,0 +1,130 @@
+#include "dns/cache.h"
+#include "domain_index.h"
+#include "esp_timer.h"
+#include "string.h"
+
+#include <vector>
+#include <algorithm>
+
+#ifdef CONFIG_LOCAL_LOG_LEVEL
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#include "esp_log.h"
+static const char *TAG = "CACHE";
+
+typedef struct {
+    uint32_t hash;                          // domain_hash() of domain, compared first
+    std::string domain;
+    uint16_t qtype;
+    int64_t expires;                        // esp_timer time the answer expires
+    std::vector<ResourceRecord> answers;
+} Cache_Entry;
+
+static std::vector<Cache_Entry> cache;      // Only accessed from the dns task
+
+
+static IRAM_ATTR bool same_name(const Cache_Entry& entry, const domain_key& key)
+{
+    return entry.hash == key.hashes[0] && entry.domain.size() == key.len && 
+           memcmp(entry.domain.data(), key.name, key.len) == 0;
+}
+
+static IRAM_ATTR Cache_Entry* find(const domain_key& key, uint16_t qtype, int64_t now)
+{
+    if( key.len == 0 )
+    {
+        return NULL;
+    }
+    for( int i = 0; i < cache.size(); i++ )
+    {
+        if( cache[i].qtype == qtype && cache[i].expires > now && same_name(cache[i], key) )
+        {
+            return &cache[i];
+        }
+    }
+    return NULL;
+}
+
+// Reuse the entry for the same question, otherwise the one closest to expiring
+static IRAM_ATTR Cache_Entry* slot(const domain_key& key, uint16_t qtype)
+{
+    if( cache.size() < CACHE_SIZE )
+    {
+        cache.resize(cache.size() + 1);
+        return &cache.back();
+    }
+
+    Cache_Entry* oldest = &cache[0];
+    for( int i = 0; i < cache.size(); i++ )
+    {
+        if( cache[i].qtype == qtype && same_name(cache[i], key) )
+        {
+            return &cache[i];
+        }
+        if( cache[i].expires < oldest->expires )
+        {
+            oldest = &cache[i];
+        }
+    }
+    return oldest;
+}
+
+IRAM_ATTR void cache_answer(DNS* packet, const domain_key& key)
+{
+    int ancount = ntohs(packet->header.ancount);
+    if( key.len == 0 || packet->header.rcode != NOERROR || packet->header.tc || ancount == 0 || ancount > packet->records.size() )
+    {
+        return;
+    }
+
+    uint32_t ttl = CACHE_MAX_TTL;
+    for( int i = 0; i < ancount; i++ )
+    {
+        ttl = std::min(ttl, packet->records[i].ttl);
+    }
+    if( ttl == 0 )
+    {
+        return;
+    }
+
+    Cache_Entry* entry = slot(key, packet->question.qtype);
+    entry->hash = key.hashes[0];
+    entry->domain.assign(key.name, key.len);
+    entry->qtype = packet->question.qtype;
+    entry->expires = esp_timer_get_time() + (int64_t)ttl*1000000;
+    entry->answers.assign(packet->records.begin(), packet->records.begin() + ancount);
+    ESP_LOGV(TAG, "Cached %s (%d) for %u s", key.name, entry->qtype, ttl);
+}
+
+IRAM_ATTR bool answer_from_cache(DNS* packet, const domain_key& key)
+{
+    int64_t now = esp_timer_get_time();
+    Cache_Entry* entry = find(key, packet->question.qtype, now);
+    if( entry == NULL )
+    {
+        return false;
+    }
+
+    // Answer names are compression pointers into the upstream packet, they stay valid 
+    // because the question is the same length and the answer section comes right after it
+    uint32_t remaining = (entry->expires - now) / 1000000 + 1;
+    packet->records = entry->answers;
+    for( ResourceRecord& record : packet->records )
+    {
+        record.ttl = std::min(record.ttl, remaining);
+    }
+
+    packet->header.qr = 1;
+    packet->header.ra = 1;
+    packet->header.rcode = NOERROR;
+    packet->header.ancount = htons(packet->records.size());
+    packet->header.nscount = 0;
+    packet->header.arcount = 0;
+    ESP_LOGD(TAG, "Answering %s from cache", key.name);
+    return true;
+}
+
+IRAM_ATTR bool in_cache(const domain_key& key, uint16_t qtype)
+{
+    return find(key, qtype, esp_timer_get_time()) != NULL;
+}
@@ -1,6 +1,9 @@
 #include "dns/dns.h"
+#include "domain_index.h"
 
 #include <stdexcept>
+#include <ctype.h>
+#include <algorithm>
 
 #ifdef CONFIG_LOCAL_LOG_LEVEL
 #define LOG_LOCAL_LEVEL ESP_LOG_INFO
@@ -41,18 +44,59 @@ IRAM_ATTR std::vector<uint8_t> ResourceRecord::serialize()
 
 IRAM_ATTR esp_err_t DNS::unpack_name(std::vector<uint8_t>* buffer, int* index, std::vector<uint8_t>* name)
 {
-    uint8_t byte = 0;
+    uint8_t len = 0;
     do {
-        byte = buffer->at(*index);
-        name->push_back(byte);
+        len = buffer->at(*index);
+        name->push_back(len);
         *index += 1;
-    } while ( byte != 0xC0 && byte != 0 );
 
-    if( byte == 0xC0 )
+        if( (len & 0xC0) == 0xC0 ) // compression pointer, second byte is rest of offset
+        {
+            name->push_back(buffer->at(*index));
+            *index += 1;
+            break;
+        }
+
+        unpack_vector(buffer, index, len, name);
+    } while ( len != 0 );
+
+    return ESP_OK;
+}
+
+// Decompress name starting at index into lowercase dotted form
+IRAM_ATTR esp_err_t DNS::read_name(std::vector<uint8_t>* buffer, int index, std::string* name)
+{
+    int jumps = 0;
+    uint8_t len = buffer->at(index);
+    while( len != 0 )
     {
-        byte = buffer->at(*index);
-        name->push_back(byte);
-        *index += 1;
+        if( (len & 0xC0) == 0xC0 )
+        {
+            if( ++jumps > MAX_POINTER_JUMPS )
+            {
+                return ESP_FAIL;
+            }
+            index = ((len & 0x3F) << 8) | buffer->at(index+1);
+        }
+        else
+        {
+            if( !name->empty() )
+            {
+                name->push_back('.');
+            }
+            for( int i = 1; i <= len; i++ )
+            {
+                // A '.' inside a label would change the labels of the dotted name
+                uint8_t c = buffer->at(index+i);
+                if( c == '.' )
+                {
+                    return ESP_FAIL;
+                }
+                name->push_back(tolower(c));
+            }
+            index += len + 1;
+        }
+        len = buffer->at(index);
     }
 
     return ESP_OK;
@@ -73,12 +117,11 @@ IRAM_ATTR esp_err_t DNS::unpack_vector(std::vector<uint8_t>* buffer, int* index,
 template<typename T>
 IRAM_ATTR esp_err_t DNS::unpack(std::vector<uint8_t>* buffer, int* index, T* dest)
 {
+    *dest = 0;
     for( int i = 0; i < sizeof(T); i++ )
     {
         uint8_t byte = buffer->at(*index);
-        *dest = *dest << i*8;
-        *dest = *dest && 0x00;
-        *dest = *dest | byte;
+        *dest = (*dest << 8) | byte;
         *index += 1;
     }
 
@@ -143,28 +186,30 @@ IRAM_ATTR DNS::DNS(std::vector<uint8_t>* buffer, sockaddr_in addr_, socklen_t ad
         unpack(buffer, &cursor, &records[i].rdlength);
         ESP_LOGV(TAG, "RDLEN   (%.4X)\n", records[i].rdlength);
 
+        int rdstart = cursor;
         unpack_vector(buffer, &cursor, records[i].rdlength, &records[i].rddata);
+
+        // CNAME targets may point anywhere in the packet, so decompress them while the buffer is available
+        if( header.qr == ANSWER && i < ntohs(header.ancount) && records[i].type == CNAME )
+        {
+            std::string target;
+            if( read_name(buffer, rdstart, &target) == ESP_OK )
+            {
+                ESP_LOGV(TAG, "CNAME   (%s)", target.c_str());
+                cnames.push_back(target);
+            }
+        }
         // ESP_LOGV(TAG, "RDDATA  (%.*X)(%d)\n", records[i].rddata.size(), (int*)records[i].rddata.data(), records[i].rddata.size());
     }
 }
 
-IRAM_ATTR std::string DNS::convert_qname_url()
+// Lowercase dotted qname with its suffix hashes, shared by the cache, lists and log
+IRAM_ATTR bool DNS::qname_key(domain_key* key)
 {
-    std::string domain (question.qname.begin(), question.qname.end());
-
-    int i = 0;
-    while( domain[i] != '\0')
-    {
-        size_t jmp = (int)domain[i];
-        domain[i] = '.';
-        i += jmp + 1;
-    }
-    
-    domain.erase(0,1); // rease first '.'
-    return domain;
+    return wire_domain_key(question.qname.data(), question.qname.size(), key);
 }
 
-IRAM_ATTR esp_err_t DNS::add_answer(const char* ip_str)
+IRAM_ATTR esp_err_t DNS::add_answer(const char* ip_str, uint32_t ttl)
 {
     header.qr = 1; // change packet to answer
     header.aa = 1; // respect my authoritah
@@ -177,7 +222,7 @@ IRAM_ATTR esp_err_t DNS::add_answer(const char* ip_str)
     memcpy(answer.name.data(), &name, sizeof(name));
 
     answer.clss = 1;
-    answer.ttl = 128;
+    answer.ttl = ttl;
 
     if( question.qtype == A )
     {
@@ -202,6 +247,43 @@ IRAM_ATTR esp_err_t DNS::add_answer(const char* ip_str)
     return ESP_OK;
 }
 
+// Negative answers (NXDOMAIN/NODATA) are cached for the SOA minimum field
+// (RFC 2308), so one is added to the authority section to control the TTL
+IRAM_ATTR esp_err_t DNS::add_soa(uint32_t ttl)
+{
+    header.qr = 1;
+    header.aa = 1;
+    header.nscount = htons(ntohs(header.nscount) + 1);
+    header.arcount = 0;
+
+    ResourceRecord soa;
+    uint16_t name = htons(0xC00C);
+    soa.name.resize(sizeof(name));
+    memcpy(soa.name.data(), &name, sizeof(name));
+
+    soa.type = SOA;
+    soa.clss = 1;
+    soa.ttl = ttl;
+
+    // mname & rname point back to qname, followed by serial, refresh, retry, expire & minimum
+    uint32_t fields[] = { 1, ttl, ttl, ttl, ttl };
+    soa.rddata.resize(2*sizeof(name));
+    memcpy(soa.rddata.data(), &name, sizeof(name));
+    memcpy(soa.rddata.data() + sizeof(name), &name, sizeof(name));
+    for( uint32_t field : fields )
+    {
+        soa.rddata.push_back(field >> 24);
+        soa.rddata.push_back(field >> 16);
+        soa.rddata.push_back(field >> 8);
+        soa.rddata.push_back(field);
+    }
+    soa.rdlength = soa.rddata.size();
+
+    records.push_back(soa);
+
+    return ESP_OK;
+}
+
 IRAM_ATTR esp_err_t DNS::send(int socket, struct sockaddr_in addr)
         {
             auto const ptr = reinterpret_cast<uint8_t*>(&header);
@@ -0,0 +1,51 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <esp_system.h>
+#include "dns/dns.h"
+#include <string>
+
+#define CACHE_SIZE 64           // Number of answers kept in cache
+#define CACHE_MAX_TTL 86400     // Upper bound on time answers are kept, in seconds
+
+struct domain_key;              // See domain_index.h
+
+/**
+  * @brief Store the answer section of an upstream answer
+  * 
+  * Only successful answers with at least one record are stored, they
+  * expire after the smallest TTL among the answer records
+  *
+  * @param packet answer received from upstream server
+  *
+  * @param key key of the question's name
+  */
+void cache_answer(DNS* packet, const domain_key& key);
+
+/**
+  * @brief Turn query into an answer from cache
+  *
+  * @param packet query to be answered, packet still has to be sent
+  * 
+  * @param key key of the question's name
+  *
+  * @return
+  *     - true Answer was in cache, packet now holds the answer
+  *     - false Not in cache, packet unchanged
+  */
+bool answer_from_cache(DNS* packet, const domain_key& key);
+
+/**
+  * @brief Check if an unexpired answer is cached
+  *
+  * @param key key of the name
+  * 
+  * @param qtype record type
+  *
+  * @return
+  *     - true In cache
+  *     - false Not in cache
+  */
+bool in_cache(const domain_key& key, uint16_t qtype);
+
+#endif
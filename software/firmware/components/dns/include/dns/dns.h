@@ -8,6 +8,9 @@
 
 
 #define MAX_PACKET_SIZE 512
+#define MAX_POINTER_JUMPS 16    // Bound on compression pointers followed while decompressing a name
+
+struct domain_key;              // See domain_index.h
 
 /**
   * @brief structs and enums used to parse DNS packets
@@ -27,9 +30,17 @@ enum QRFlag {
 enum RecordTypes {
     A=1,
     NS=2,
+    CNAME=5,
+    SOA=6,
     AAAA=28,
 };
 
+enum ResponseCodes {
+    NOERROR=0,
+    SERVFAIL=2,
+    NXDOMAIN=3,
+};
+
 typedef struct header{
     uint16_t id;        // identification number
  
@@ -73,6 +84,7 @@ class ResourceRecord {
 class DNS {
     private:
         IRAM_ATTR esp_err_t unpack_name(std::vector<uint8_t>* buffer, int* index, std::vector<uint8_t>* name);
+        IRAM_ATTR esp_err_t read_name(std::vector<uint8_t>* buffer, int index, std::string* name);
         IRAM_ATTR esp_err_t unpack_vector(std::vector<uint8_t>* buffer, int* index, size_t size, std::vector<uint8_t>* dest);
         template<typename T>
         IRAM_ATTR esp_err_t unpack(std::vector<uint8_t>* buffer, int* index, T* dest);
@@ -84,10 +96,12 @@ class DNS {
         Header header;
         Question question;
         std::vector<ResourceRecord> records;
+        std::vector<std::string> cnames;    // Decompressed CNAME targets from the answer section
 
         IRAM_ATTR DNS(std::vector<uint8_t>* buffer, sockaddr_in addr_, socklen_t addrlen_);
-        IRAM_ATTR std::string convert_qname_url();
-        IRAM_ATTR esp_err_t add_answer(const char* ip_str);
+        IRAM_ATTR bool qname_key(domain_key* key);
+        IRAM_ATTR esp_err_t add_answer(const char* ip_str, uint32_t ttl = 128);
+        IRAM_ATTR esp_err_t add_soa(uint32_t ttl);
         IRAM_ATTR esp_err_t send(int socket, struct sockaddr_in addr);
 };
 
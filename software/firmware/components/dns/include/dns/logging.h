@@ -32,7 +32,7 @@ size_t get_log_size();
 /**
   * @brief Add entry to log
   * 
-  * @param url URL structure with string of URL to be added
+  * @param domain lowercase domain of the query
   *
   * @param blocked boolean of wether the query was blocked
   * 
@@ -42,7 +42,7 @@ size_t get_log_size();
   *    - ESP_OK Success
   *    - ESP_FAIL Failure
   */
-esp_err_t log_query(std::string domain, bool blocked, uint16_t type, uint32_t client);
+esp_err_t log_query(const char* domain, bool blocked, uint16_t type, uint32_t client);
 
 /**
   * @brief Start logging tasks
@@ -3,14 +3,27 @@
 
 #include <esp_system.h>
 #include "lwip/sockets.h"
+#include <string>
 
 #define DNS_PORT 53
 #define MAX_URL_LENGTH 255
 
+enum BlockMode {
+    BLOCK_NULL_IP,      // Answer with 0.0.0.0 / ::
+    BLOCK_CUSTOM_IP,    // Answer with the configured sinkhole address
+    BLOCK_NODATA,       // NOERROR with an empty answer section
+    BLOCK_NXDOMAIN      // Domain does not exist
+};
+
 typedef struct {
     struct sockaddr_in src_address;
-	uint16_t id;
+    uint16_t lists;             // Blocklists of the client's policy group
+	uint16_t id;                // id of query sent upstream
+    uint16_t reply_id;          // id the client expects in its answer
     int64_t response_latency;
+    bool prefetch;              // No client waiting yet, answer is only cached
+    uint16_t qtype;             // Question of a pending prefetch
+    std::string domain;
 } Client;
 
 /**
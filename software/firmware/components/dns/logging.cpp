@@ -27,7 +27,7 @@ size_t get_log_size()
     return log.size();
 }
 
-esp_err_t log_query(std::string domain, bool blocked, uint16_t type, uint32_t client)
+esp_err_t log_query(const char* domain, bool blocked, uint16_t type, uint32_t client)
 {
     Log_Entry entry = {};
     time(&entry.time);
@@ -1,10 +1,12 @@
 #include "dns/dns.h"
 #include "dns/server.h"
 #include "dns/logging.h"
+#include "dns/cache.h"
 #include "error.h"
 #include "events.h"
 #include "settings.h"
 #include "lists.h"
+#include "domain_index.h"
 
 #include "errno.h"
 #include "stdio.h"
@@ -16,6 +18,7 @@
 #include "lwip/ip_addr.h"
 
 #include <stdexcept>
+#include <algorithm>
 
 #ifdef CONFIG_LOCAL_LOG_LEVEL
 #define LOG_LOCAL_LEVEL ESP_LOG_INFO
@@ -33,6 +36,11 @@ static QueueHandle_t packet_queue;                      // FreeRTOS queue of DNS
 static SemaphoreHandle_t client_mutex;
 static std::vector<Client> client_queue;                // FIFO Array of clients waiting for DNS response
 
+static BlockMode block_mode;                            // How blocked queries are answered
+static uint32_t block_ttl;                              // TTL of blocked answers
+static std::string block_ip;                            // Sinkhole address for blocked A queries
+static std::string block_ip6;                           // Sinkhole address for blocked AAAA queries
+
 
 static IRAM_ATTR void listening_t(void* parameters)
 {
@@ -71,7 +79,12 @@ static IRAM_ATTR void listening_t(void* parameters)
 }
 
 
-static IRAM_ATTR esp_err_t forward_answer(DNS* packet)
+static IRAM_ATTR void block_response(DNS* packet);
+
+// Forward answer to the client waiting for it, blocking is the lists blocking the answer.
+// The answer is blocked for clients using one of them or for everyone if an address is
+// in a blocked IP range, and only cached if nothing blocks it
+static IRAM_ATTR esp_err_t forward_answer(DNS* packet, const domain_key& key, uint16_t blocking, bool address)
 {
     if( xSemaphoreTake(client_mutex, 25/portTICK_PERIOD_MS) == pdFALSE )
     {
@@ -79,20 +92,52 @@ static IRAM_ATTR esp_err_t forward_answer(DNS* packet)
         return ESP_FAIL;
     }
 
+    Client client;
+    bool found = false;
     for(int i = 0; i < client_queue.size(); i++)
     {
         if( packet->header.id == client_queue[i].id )
         {
-            ESP_LOGV(TAG, "Forwarding answer to %s", inet_ntoa(client_queue[i].src_address.sin_addr.s_addr));
-            packet->send(dns_srv_sock, client_queue[i].src_address);
+            client = client_queue[i];
+            client_queue.erase(client_queue.begin() + i);
+            found = true;
             break;
         }
     }
     xSemaphoreGive(client_mutex);
+
+    if( !found )
+    {
+        ESP_LOGV(TAG, "No client waiting for answer %.4X", packet->header.id);
+        return ESP_OK;
+    }
+
+    if( blocking == 0 && !address )
+        cache_answer(packet, key);
+
+    bool blocked = address || (blocking & client.lists) != 0;
+    if( blocked )
+    {
+        ESP_LOGW(TAG, "Blocking answer for %s", key.name);
+        block_response(packet);
+        set_bit(BLOCKED_QUERY_BIT);
+    }
+
+    if( client.prefetch )
+    {
+        ESP_LOGV(TAG, "Prefetched %s", client.domain.c_str());
+        return ESP_OK;
+    }
+
+    ESP_LOGV(TAG, "Forwarding answer to %s", inet_ntoa(client.src_address.sin_addr.s_addr));
+    packet->header.id = client.reply_id;
+    packet->send(dns_srv_sock, client.src_address);
+    if( blocked )
+        log_query(key.name, true, packet->question.qtype, client.src_address.sin_addr.s_addr);
     return ESP_OK;
 }
 
-static IRAM_ATTR esp_err_t add_client(DNS* packet)
+static IRAM_ATTR esp_err_t add_client(DNS* packet, bool prefetch = false, const std::string& domain = "")
 {
     if( xSemaphoreTake(client_mutex, 25/portTICK_PERIOD_MS) == pdFALSE )
     {
@@ -100,10 +145,25 @@ static IRAM_ATTR esp_err_t add_client(DNS* packet)
         return ESP_FAIL;
     }
 
+    // Only one prefetch of a question is sent upstream, even after a client claimed it
+    for(int i = 0; prefetch && i < client_queue.size(); i++)
+    {
+        if( client_queue[i].qtype == packet->question.qtype && client_queue[i].domain == domain )
+        {
+            xSemaphoreGive(client_mutex);
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+
     Client client;
     client.src_address = packet->addr;
+    client.lists = client_lists((const uint8_t*)&packet->addr.sin_addr.s_addr, 4);
     client.id = packet->header.id;
+    client.reply_id = packet->header.id;
     client.response_latency = packet->recv_timestamp;
+    client.prefetch = prefetch;
+    client.qtype = packet->question.qtype;
+    client.domain = domain;
 
     client_queue.push_back(client);
     if( client_queue.size() == CLIENT_QUEUE_SIZE )
@@ -113,6 +173,147 @@ static IRAM_ATTR esp_err_t add_client(DNS* packet)
     return ESP_OK;
 }
 
+// Hand a pending prefetch for the same question over to this client, instead of asking upstream again
+static IRAM_ATTR bool claim_prefetch(DNS* packet, const domain_key& key)
+{
+    if( xSemaphoreTake(client_mutex, 25/portTICK_PERIOD_MS) == pdFALSE )
+    {
+        return false;
+    }
+
+    bool claimed = false;
+    for(int i = 0; i < client_queue.size(); i++)
+    {
+        Client& client = client_queue[i];
+        if( client.prefetch && client.qtype == packet->question.qtype && client.domain == key.name )
+        {
+            client.src_address = packet->addr;
+            client.lists = client_lists((const uint8_t*)&packet->addr.sin_addr.s_addr, 4);
+            client.reply_id = packet->header.id;
+            client.response_latency = packet->recv_timestamp;
+            client.prefetch = false;
+            claimed = true;
+            break;
+        }
+    }
+
+    xSemaphoreGive(client_mutex);
+    return claimed;
+}
+
+// Dual-stack clients send A & AAAA back to back, ask for the other type as soon as one is forwarded
+static IRAM_ATTR void prefetch_sibling(DNS* packet, const domain_key& key, struct sockaddr_in upstream)
+{
+    uint16_t qtype = packet->question.qtype;
+    if( qtype != A && qtype != AAAA )
+        return;
+
+    uint16_t sibling_type = (qtype == A) ? AAAA : A;
+    if( in_cache(key, sibling_type) )
+        return;
+
+    DNS sibling(*packet);
+    sibling.question.qtype = sibling_type;
+    sibling.header.id = esp_random();
+    sibling.records.clear();
+    sibling.header.ancount = 0;
+    sibling.header.nscount = 0;
+    sibling.header.arcount = 0;
+
+    ESP_LOGD(TAG, "Prefetching %s (%d)", key.name, sibling_type);
+    if( add_client(&sibling, true, key.name) == ESP_OK )
+        sibling.send(dns_srv_sock, upstream);
+}
+
+static BlockMode parse_block_mode(const std::string& mode)
+{
+    if( mode == "nxdomain" )
+        return BLOCK_NXDOMAIN;
+    else if( mode == "nodata" )
+        return BLOCK_NODATA;
+    else if( mode == "custom" )
+        return BLOCK_CUSTOM_IP;
+    else
+        return BLOCK_NULL_IP;
+}
+
+static void load_block_settings()
+{
+    block_mode = parse_block_mode(setting::read_str(setting::BLOCK_MODE));
+    block_ip = setting::read_str(setting::BLOCK_IP);
+    block_ip6 = setting::read_str(setting::BLOCK_IP6);
+
+    int ttl = setting::read_int(setting::BLOCK_TTL);
+    block_ttl = ttl > 0 ? ttl : 0;
+    ESP_LOGV(TAG, "Block mode %d, TTL %u", block_mode, block_ttl);
+}
+
+// Turn packet into the configured block response, packet still has to be sent
+static IRAM_ATTR void block_response(DNS* packet)
+{
+    packet->records.clear();
+    packet->header.ancount = 0;
+    packet->header.nscount = 0;
+    packet->header.arcount = 0;
+    packet->header.rcode = NOERROR;
+
+    uint16_t qtype = packet->question.qtype;
+    if( block_mode == BLOCK_NXDOMAIN )
+    {
+        packet->header.rcode = NXDOMAIN;
+        packet->add_soa(block_ttl);
+    }
+    else if( block_mode == BLOCK_NODATA )
+    {
+        packet->add_soa(block_ttl);
+    }
+    else if( qtype == A )
+    {
+        packet->add_answer(block_mode == BLOCK_CUSTOM_IP ? block_ip.c_str() : "0.0.0.0", block_ttl);
+    }
+    else if( qtype == AAAA )
+    {
+        packet->add_answer(block_mode == BLOCK_CUSTOM_IP ? block_ip6.c_str() : "::", block_ttl);
+    }
+    else // There is no address to give for other types (HTTPS, SVCB, CNAME, TXT...), answer with NODATA
+    {
+        packet->add_soa(block_ttl);
+    }
+}
+
+// Lists blocking any CNAME target in an answer, catches trackers cloaked behind first-party names
+static IRAM_ATTR uint16_t cname_blocking(DNS* packet)
+{
+    uint16_t lists = 0;
+    for( const std::string& target : packet->cnames )
+    {
+        uint16_t blocking = blocking_lists(target.c_str());
+        if( blocking != 0 )
+            ESP_LOGW(TAG, "CNAME target %s is blocked", target.c_str());
+        lists |= blocking;
+    }
+    return lists;
+}
+
+// Check if any address in the answer section falls into a blocked IP range
+static IRAM_ATTR bool address_blocked(DNS* packet)
+{
+    int ancount = ntohs(packet->header.ancount);
+    for( int i = 0; i < ancount && i < packet->records.size(); i++ )
+    {
+        const ResourceRecord& record = packet->records[i];
+        if( (record.type == A && record.rdlength == 4) || (record.type == AAAA && record.rdlength == 16) )
+        {
+            if( ip_in_blacklist(record.rddata.data(), record.rdlength) )
+            {
+                ESP_LOGW(TAG, "Answer address is in a blocked range");
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 static IRAM_ATTR void dns_t(void* parameters)
 {
     struct sockaddr_in upstream_dns;
@@ -122,12 +323,17 @@ static IRAM_ATTR void dns_t(void* parameters)
     ip4addr_aton(ip.c_str(), (ip4_addr_t *)&upstream_dns.sin_addr.s_addr);
     ESP_LOGV(TAG, "Upstream DNS: %s", inet_ntoa(upstream_dns.sin_addr.s_addr));
 
-    char device_url[MAX_URL_LENGTH];
+    // Compared with lowercase names of queries
+    char device_url[MAX_URL_LENGTH+1];
     std::string url = setting::read_str(setting::HOSTNAME);
-    strcpy(device_url, url.c_str());
+    url.resize(std::min<size_t>(url.size(), MAX_URL_LENGTH));
+    normalize_domain(url.c_str(), device_url);
     ESP_LOGV(TAG, "Device URL: %s", device_url);
 
+    load_block_settings();
+
     DNS* packet = NULL;
+    domain_key key;         // Name of the current packet, made once for every lookup
     while(1) 
     {
         delete packet;
@@ -139,59 +345,70 @@ static IRAM_ATTR void dns_t(void* parameters)
             continue;
         }
 
-        std::string domain = packet->convert_qname_url();
-        ESP_LOGD(TAG, "Domain  (%s)",   domain.c_str());
+        packet->qname_key(&key);
+        ESP_LOGD(TAG, "Domain  (%s)",   key.name);
 
         if( packet->header.qr == ANSWER ) // Forward all answers
         {
-            ESP_LOGV(TAG, "Forwarding answer for %s", domain.c_str());
-            forward_answer(packet);
+            // IP ranges aren't part of any list and block for every client
+            uint16_t blocking = 0;
+            bool address = false;
+            if( setting::read_bool(setting::BLOCK) )
+            {
+                address = address_blocked(packet);
+                if( !address )
+                    blocking = cname_blocking(packet);
+            }
+
+            ESP_LOGV(TAG, "Forwarding answer for %s", key.name);
+            forward_answer(packet, key, blocking, address);
         }
         else if( packet->header.qr == QUERY )
         {
             uint16_t qtype = packet->question.qtype;
-            if( !(qtype == A || qtype == AAAA) ) // Forward all queries that are not A & AAAA
+            bool address_query = (qtype == A || qtype == AAAA);
+            vTaskDelay(0); // This yields to higher priority tasks, watchdog may get triggered without this
+            if( address_query && strcmp(key.name, device_url) == 0 ) // Check is qname matches current device url
             {
-                ESP_LOGI(TAG, "Forwarding question for %s", domain.c_str());
-                if( add_client(packet) == ESP_OK )
-                    packet->send(dns_srv_sock, upstream_dns);
-                log_query(domain, false, qtype, packet->addr.sin_addr.s_addr);
+                ESP_LOGW(TAG, "Capturing DNS request %s", key.name);
+                std::string ip_str = setting::read_str(setting::IP);
+                packet->records.clear();
+                packet->header.arcount = 0;
+                packet->question.qtype = A;
+                packet->add_answer(ip_str.c_str());
+                packet->send(dns_srv_sock, packet->addr);
+                log_query(key.name, false, qtype, packet->addr.sin_addr.s_addr);
+                set_bit(BLOCKED_QUERY_BIT);
             }
-            else 
+            else if( setting::read_bool(setting::BLOCK) && 
+                     in_blacklist(key, client_lists((const uint8_t*)&packet->addr.sin_addr.s_addr, 4)) ) // check if url is in blacklist for the client's lists, for every qtype
             {
-                vTaskDelay(0); // This yields to higher priority tasks, watchdog may get triggered without this
-                if( memcmp(domain.c_str(), device_url, domain.size()) == 0 ) // Check is qname matches current device url
+                ESP_LOGW(TAG, "Blocking question for %s", key.name);
+                block_response(packet);
+                packet->send(dns_srv_sock, packet->addr);
+                log_query(key.name, true, qtype, packet->addr.sin_addr.s_addr);
+                set_bit(BLOCKED_QUERY_BIT);
+            }
+            else
+            {
+                if( answer_from_cache(packet, key) )
                 {
-                    ESP_LOGW(TAG, "Capturing DNS request %s", domain.c_str());
-                    std::string ip_str = setting::read_str(setting::IP);
-                    packet->records.clear();
-                    packet->header.arcount = 0;
-                    packet->question.qtype = A;
-                    packet->add_answer(ip_str.c_str());
                     packet->send(dns_srv_sock, packet->addr);
-                    log_query(domain, false, qtype, packet->addr.sin_addr.s_addr);
-                    set_bit(BLOCKED_QUERY_BIT);
                 }
-                else if( setting::read_bool(setting::BLOCK) && in_blacklist(domain.c_str()) ) // check if url is in blacklist
+                else if( claim_prefetch(packet, key) )
                 {
-                    ESP_LOGW(TAG, "Blocking question for %s", domain.c_str());
-                    packet->records.clear();
-                    packet->header.arcount = 0;
-                    if( qtype == A )
-                        packet->add_answer("0.0.0.0");
-                    else if( qtype == AAAA )
-                        packet->add_answer("::");
-                    packet->send(dns_srv_sock, packet->addr);
-                    log_query(domain, true, qtype, packet->addr.sin_addr.s_addr);
-                    set_bit(BLOCKED_QUERY_BIT);
+                    ESP_LOGI(TAG, "Waiting on prefetch for %s", key.name);
                 }
                 else
                 {
-                    ESP_LOGI(TAG, "Forwarding question for %s", domain.c_str());
+                    ESP_LOGI(TAG, "Forwarding question for %s", key.name);
                     if( add_client(packet) == ESP_OK )
+                    {
                         packet->send(dns_srv_sock, upstream_dns);
-                    log_query(domain, false, qtype, packet->addr.sin_addr.s_addr);
+                        prefetch_sibling(packet, key, upstream_dns);
+                    }
                 }
+                log_query(key.name, false, qtype, packet->addr.sin_addr.s_addr);
             }
         }
 
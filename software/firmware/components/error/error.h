@@ -32,6 +32,7 @@ class Err : public std::exception {
 #define URL_ERR_NOT_FOUND           (URL_ERR_BASE + 4)      // Can not find URL
 #define URL_ERR_ALREADY_EXISTS      (URL_ERR_BASE + 5)      // URL is already in blacklist
 #define URL_ERR_INVALID_URL         (URL_ERR_BASE + 6)      // URL contains invalid characters
+#define URL_ERR_DOWNLOAD            (URL_ERR_BASE + 7)      // Unable to download subscribed list
 
 #define LOG_ERR_BASE                0x400
 #define LOG_ERR_LOG_UNAVAILABLE     (LOG_ERR_BASE + 1)      // Cannot access log file
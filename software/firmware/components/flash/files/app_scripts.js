@@ -103,6 +103,35 @@ function addToBlacklist(){
     updateBlacklist("PUT", urlinput.value)
 }
 
+function uploadBlacklist(){
+    let err = document.getElementById('error');
+    let file = document.getElementById('listfile').files[0];
+    if( file === undefined )
+        return;
+
+    let button = document.getElementById('uploadbutton');
+    button.disabled = true;
+
+    // Hosts, Adblock or plain lists are added to the blacklist
+    let http = new XMLHttpRequest();
+    http.open("POST", "/blacklist/upload?append=1");
+
+    http.onreadystatechange = function(){
+        if (http.readyState == 4){
+            button.disabled = false;
+            if (http.status == 200){
+                err.style.visibility = 'hidden';
+                location.href = "/blacklist"
+            }
+            else{
+                err.innerHTML = http.responseText;
+                err.style.visibility = 'visible';
+            }
+        }
+    };
+    http.send(file);
+}
+
 function updateBlacklist(action, hostname){
     let err = document.getElementById('error');
     let http = new XMLHttpRequest();
@@ -143,6 +172,10 @@ function loadSettings(){
                 var dnssrv = document.getElementsByName("dnssrv")[0];
                 var url = document.getElementsByName("url")[0];
                 var ip = document.getElementsByName("ip")[0];
+                var blockmode = document.getElementsByName("blockmode")[0];
+                var blockip = document.getElementsByName("blockip")[0];
+                var blockip6 = document.getElementsByName("blockip6")[0];
+                var blockttl = document.getElementsByName("blockttl")[0];
                 var update_available = document.getElementById("update_available");
                 var updateButton = document.getElementById("updateButton");
 
@@ -172,6 +205,28 @@ function loadSettings(){
                     }
                 }
 
+                for(let j = 0; j < blockmode.options.length; j++){
+                    if (blockmode.options[j].value == settings.block_mode){
+                        blockmode.selectedIndex = j;
+                        blockmode.disabled = false;
+                    }
+                }
+
+                if(settings.block_ip){
+                    blockip.value = settings.block_ip;
+                    blockip.disabled = false
+                }
+
+                if(settings.block_ip6){
+                    blockip6.value = settings.block_ip6;
+                    blockip6.disabled = false
+                }
+
+                if(settings.block_ttl !== undefined){
+                    blockttl.value = settings.block_ttl;
+                    blockttl.disabled = false
+                }
+
                 if( settings.blocking ){
                     button.innerHTML = 'Blocking On';
                     button.className = "";
@@ -299,4 +354,4 @@ function restartFinished()
         }
     };
     http.send();
-}
\ No newline at end of file
+}
\ No newline at end of file
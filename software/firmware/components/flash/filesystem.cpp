@@ -7,8 +7,10 @@
 #include "esp_ota_ops.h"
 #include "errno.h"
 #include "esp_littlefs.h"
+#include "dirent.h"
 
 #include <string>
+#include <vector>
 
 #ifdef CONFIG_LOCAL_LOG_LEVEL
 #define LOG_LOCAL_LEVEL ESP_LOG_INFO
@@ -123,6 +125,16 @@ void fs::rename(std::string before, std::string after)
     ESP_LOGW(TAG, "Saved %s", #SRC );                                           \
 }
 
+static void move_from_prev_dir(const char* path)
+{
+    std::string old_path = prev_dir + path;
+    std::string new_path = curr_dir + path;
+    if( ::rename(old_path.c_str(), new_path.c_str()) != 0 )
+    {
+        THROWE(errno, "Error renameing %s, %s", old_path.c_str(), strerror(errno))
+    }
+}
+
 static void copy_from_binary()
 {
     using namespace fs;                                     
@@ -138,18 +150,44 @@ static void copy_from_binary()
     struct stat s;
     if( ::stat(std::string(prev_dir+"/settings.json").c_str(), &s) == 0)
     {
-        std::string old_path = prev_dir + "/settings.json";
-        std::string new_path = curr_dir + "/settings.json";
-        if( ::rename(old_path.c_str(), new_path.c_str()) != 0 )
+        move_from_prev_dir("/settings.json");
+        move_from_prev_dir("/blacklist.txt");
+
+        // Optional lists, may not exist on older firmware
+        if( ::stat(std::string(prev_dir+"/ipblacklist.txt").c_str(), &s) == 0)
+        {
+            move_from_prev_dir("/ipblacklist.txt");
+        }
+        if( ::stat(std::string(prev_dir+"/blacklist.journal").c_str(), &s) == 0)
+        {
+            move_from_prev_dir("/blacklist.journal");
+        }
+        if( ::stat(std::string(prev_dir+"/subscriptions.txt").c_str(), &s) == 0)
         {
-            THROWE(errno, "Error renameing %s, %s", old_path.c_str(), strerror(errno))
+            move_from_prev_dir("/subscriptions.txt");
+        }
+        if( ::stat(std::string(prev_dir+"/groups.txt").c_str(), &s) == 0)
+        {
+            move_from_prev_dir("/groups.txt");
         }
 
-        old_path = prev_dir + "/blacklist.txt";
-        new_path = curr_dir + "/blacklist.txt";
-        if( ::rename(old_path.c_str(), new_path.c_str()) != 0 )
+        // Downloaded copies of subscribed lists, collected first so
+        // the directory isn't modified while it is being read
+        std::vector<std::string> cached;
+        DIR* dir = opendir(prev_dir.c_str());
+        if( dir != NULL )
+        {
+            struct dirent* entry;
+            while( (entry = readdir(dir)) != NULL )
+            {
+                if( strncmp(entry->d_name, "sub_", 4) == 0 )
+                    cached.push_back(std::string("/") + entry->d_name);
+            }
+            closedir(dir);
+        }
+        for( size_t i = 0; i < cached.size(); i++ )
         {
-            THROWE(errno, "Error renameing %s, %s", old_path.c_str(), strerror(errno))
+            move_from_prev_dir(cached[i].c_str());
         }
 
         setting::load_settings();
@@ -176,6 +214,8 @@ void reset_fs()
 {
     fs::unlink("/settings.json");
     fs::unlink("/blacklist.txt");
+    if( fs::exists("/blacklist.journal") )
+        fs::unlink("/blacklist.journal");
     esp_restart();
 }
 
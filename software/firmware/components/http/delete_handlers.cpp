@@ -31,8 +31,10 @@ esp_err_t blacklist_delete_handler(httpd_req_t *req)
         return ESP_OK;
     }
 
+    // user_ctx selects the list
+    esp_err_t (*edit)(const char*) = (esp_err_t (*)(const char*))req->user_ctx;
     ESP_LOGD(TAG, "Removing %s", hostname);
-    esp_err_t err = remove_from_blacklist(hostname); 
+    esp_err_t err = edit(hostname); 
     if( err == URL_ERR_INVALID_URL )
     {
         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid hostname");
@@ -59,13 +61,21 @@ static httpd_uri_t blacklistremove = {
     .uri       = "/blacklist/*",
     .method    = HTTP_DELETE,
     .handler   = blacklist_delete_handler,
-    .user_ctx  = NULL
+    .user_ctx  = (void*)remove_from_blacklist
+};
+
+static httpd_uri_t allowlistremove = {
+    .uri       = "/allowlist/*",
+    .method    = HTTP_DELETE,
+    .handler   = blacklist_delete_handler,
+    .user_ctx  = (void*)remove_from_allowlist
 };
 
 
 esp_err_t register_delete_handlers(httpd_handle_t server)
 {
     ATTEMPT(httpd_register_uri_handler(server, &blacklistremove))
+    ATTEMPT(httpd_register_uri_handler(server, &allowlistremove))
 
 
     return ESP_OK;
@@ -2,11 +2,15 @@
 #include "error.h"
 #include "events.h"
 #include "filesystem.h"
+#include "lists.h"
 #include "datetime.h"
 #include "dns/logging.h"
 #include "esp_http_server.h"
 #include "lwip/inet.h"
 
+#include <vector>
+#include <new>
+
 #ifdef CONFIG_LOCAL_LOG_LEVEL
 #define LOG_LOCAL_LEVEL ESP_LOG_INFO
 #endif
@@ -15,8 +19,7 @@ static const char* TAG = "HTTP";
 
 static const char* index_html = "index.html";
 
-#define MAX_CHUNK_SIZE 1000          // Size of chunks to send
-static char chunk[MAX_CHUNK_SIZE];   // buffer for chunks
+#define MAX_CHUNK_SIZE 1000          // Size of chunks to send, buffered per request
 
 static const char* get_filename_ext(const char *filepath) 
 {
@@ -57,17 +60,21 @@ static esp_err_t send_file(httpd_req_t *req, const char* filepath)
 {
     try{
         fs::file f = fs::open(filepath, "r");
+        std::vector<char> chunk(MAX_CHUNK_SIZE);
 
         size_t chunksize;
         do {
-            chunksize = f.read(chunk, 1, MAX_CHUNK_SIZE);
-            if (httpd_resp_send_chunk(req, chunk, chunksize) != ESP_OK) {
+            chunksize = f.read(chunk.data(), 1, chunk.size());
+            if (httpd_resp_send_chunk(req, chunk.data(), chunksize) != ESP_OK) {
                 ESP_LOGE(TAG, "Error sending %s", filepath);
                 return ESP_FAIL;
             }
         } while(chunksize != 0);
     }catch(const Err& e){
         return ESP_FAIL;
+    }catch(const std::bad_alloc& e){
+        ESP_LOGE(TAG, "Not enough memory to send %s", filepath);
+        return ESP_FAIL;
     }
     return ESP_OK;
 }
@@ -97,6 +104,10 @@ esp_err_t get_handler(httpd_req_t *req)
         strcat(filepath, index_html);
     }
 
+    // Apply pending edits before the blacklist is read
+    if( strcmp(filepath, "/blacklist.txt") == 0 )
+        compact_blacklist();
+
     // Check if file exists
     if( !fs::exists(filepath) )
     {
@@ -170,10 +181,147 @@ static httpd_uri_t querylog = {
     .user_ctx  = NULL
 };
 
+static bool send_export_chunk(const char* data, size_t len, void* ctx)
+{
+    return httpd_resp_send_chunk((httpd_req_t*)ctx, data, len) == ESP_OK;
+}
+
+static esp_err_t send_list_image(httpd_req_t *req)
+{
+    uint32_t checksum = 0;
+    size_t offset = 0;
+    try{
+        std::vector<char> chunk(MAX_CHUNK_SIZE);
+        int read;
+        while( (read = read_list_image(offset, chunk.data(), chunk.size(), &checksum)) > 0 )
+        {
+            if( offset == 0 )
+            {
+                httpd_resp_set_status(req, HTTPD_200);
+                httpd_resp_set_type(req, "application/octet-stream");
+                httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"blacklist.img\"");
+            }
+            if( httpd_resp_send_chunk(req, chunk.data(), read) != ESP_OK )
+                return ESP_FAIL;
+            offset += read;
+        }
+        if( read < 0 )
+        {
+            // Already sent part of the old image, close the connection instead of ending the response
+            ESP_LOGW(TAG, "Blocklist image replaced while sending it");
+            return ESP_FAIL;
+        }
+    }catch(const std::bad_alloc& e){
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Not enough memory to send image")
+    }
+
+    if( offset == 0 )
+        SEND_ERR(req, HTTPD_404_NOT_FOUND, "No blocklist image")
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+esp_err_t blacklist_export_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "Request for %s", req->uri);
+
+    // "?format=image" sends the blocklist image as stored, otherwise every entry as text
+    char query[32] = {};
+    char format[8] = {};
+    if( httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "format", format, sizeof(format)) == ESP_OK &&
+        strcmp(format, "image") == 0 )
+    {
+        return send_list_image(req);
+    }
+
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"blacklist.txt\"");
+    if( export_blacklist(send_export_chunk, req) != ESP_OK )
+    {
+        // Close the connection so a partial list isn't taken as the whole list
+        ESP_LOGE(TAG, "Unable to export blacklist");
+        return ESP_FAIL;
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+static httpd_uri_t blacklist_export = {
+    .uri       = "/blacklist/export",
+    .method    = HTTP_GET,
+    .handler   = blacklist_export_handler,
+    .user_ctx  = NULL
+};
+
+#define DEFAULT_TOP_RULES 50
+
+struct hits_response {
+    httpd_req_t* req;
+    bool first;
+    bool failed;
+};
+
+static void send_rule_hits(const char* rule, uint32_t hits, void* ctx)
+{
+    hits_response* resp = (hits_response*)ctx;
+    if( resp->failed )
+        return;
+
+    char str[MAX_URL_LENGTH*4 + 64];
+    snprintf(str, sizeof(str), "%s{ \"rule\":\"%s\", \"hits\":%u}", resp->first ? "\n" : ",\n", rule, hits);
+    resp->first = false;
+    resp->failed = httpd_resp_sendstr_chunk(resp->req, str) != ESP_OK;
+}
+
+esp_err_t blacklist_hits_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "Request for %s", req->uri);
+
+    // "?limit=" sets the number of rules, most hits first
+    size_t limit = DEFAULT_TOP_RULES;
+    char query[32] = {};
+    char param[8] = {};
+    if( httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "limit", param, sizeof(param)) == ESP_OK )
+    {
+        limit = strtoul(param, NULL, 10);
+    }
+
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_set_type(req, "application/json");
+    if( httpd_resp_sendstr_chunk(req, "{ \"top\":[") != ESP_OK )
+        return ESP_FAIL;
+
+    hits_response resp = { req, true, false };
+    size_t rules = 0, unused = 0;
+    if( top_rules(limit, send_rule_hits, &resp, &rules, &unused) != ESP_OK || resp.failed )
+    {
+        ESP_LOGE(TAG, "Unable to send rule hits");
+        return ESP_FAIL;
+    }
+
+    char str[64];
+    snprintf(str, sizeof(str), "],\n\"rules\":%u, \"unused\":%u}", rules, unused);
+    httpd_resp_sendstr_chunk(req, str);
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static httpd_uri_t blacklist_hits = {
+    .uri       = "/blacklist/hits",
+    .method    = HTTP_GET,
+    .handler   = blacklist_hits_handler,
+    .user_ctx  = NULL
+};
+
 
 esp_err_t register_get_handlers(httpd_handle_t server)
 {
     ATTEMPT(httpd_register_uri_handler(server, &querylog))
+    ATTEMPT(httpd_register_uri_handler(server, &blacklist_export))
+    ATTEMPT(httpd_register_uri_handler(server, &blacklist_hits))
     ATTEMPT(httpd_register_uri_handler(server, &get))
     
     return ESP_OK;
@@ -5,6 +5,7 @@
 // #include "wifi.h"
 #include "filesystem.h"
 #include "settings.h"
+#include "lists.h"
 // 
 #include "ota.h"
 
@@ -12,8 +13,13 @@
 #include "freertos/task.h"
 #include "freertos/timers.h"
 #include "lwip/ip4_addr.h"
+#include "lwip/ip6_addr.h"
 
 #include <string>
+#include <algorithm>
+
+// Receive timeouts tolerated before a stalled upload is abandoned
+#define MAX_RECV_TIMEOUTS 5
 
 #ifdef CONFIG_LOCAL_LOG_LEVEL
 #define LOG_LOCAL_LEVEL ESP_LOG_INFO
@@ -60,6 +66,35 @@ esp_err_t settings_post_handler(httpd_req_t *req)
         setting::write(setting::UPDATE_SRV, param);
     }
 
+    if( httpd_query_key_value(data, "blockmode", param, sizeof(param)) == ESP_OK )
+    {
+        if( strcmp(param, "null") == 0 || strcmp(param, "custom") == 0 ||
+            strcmp(param, "nodata") == 0 || strcmp(param, "nxdomain") == 0 )
+            setting::write(setting::BLOCK_MODE, param);
+    }
+
+    if( httpd_query_key_value(data, "blockip", param, sizeof(param)) == ESP_OK )
+    {
+        ip4_addr_t addr;
+        if( ip4addr_aton(param, &addr) > 0)
+            setting::write(setting::BLOCK_IP, param);
+    }
+
+    if( httpd_query_key_value(data, "blockip6", param, sizeof(param)) == ESP_OK )
+    {
+        ip6_addr_t addr;
+        if( ip6addr_aton(param, &addr) > 0)
+            setting::write(setting::BLOCK_IP6, param);
+    }
+
+    if( httpd_query_key_value(data, "blockttl", param, sizeof(param)) == ESP_OK )
+    {
+        char* end;
+        long ttl = strtol(param, &end, 10);
+        if( *end == '\0' && end != param && ttl >= 0 && ttl <= 604800 )
+            setting::write(setting::BLOCK_TTL, (int)ttl);
+    }
+
     httpd_resp_set_type(req, "text/html");
     httpd_resp_set_status(req, "302 Found");
     httpd_resp_set_hdr(req, "Location", "/settings?status=success");
@@ -101,6 +136,40 @@ static httpd_uri_t toggleblock = {
     .user_ctx  = NULL
 };
 
+esp_err_t togglecategory_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST to %s", req->uri);
+
+    // "?name=ads" flips blocking of one category
+    char query[32] = {};
+    char name[16] = {};
+    int category = -1;
+    if( httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "name", name, sizeof(name)) == ESP_OK )
+    {
+        category = parse_categories(name);
+    }
+    if( category <= 0 )
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Unknown category")
+
+    uint8_t enabled = enabled_categories() ^ category;
+    set_enabled_categories(enabled);
+    setting::write(setting::CATEGORIES, (int)enabled);
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_sendstr(req, (enabled & category) ? "true":"false" );
+
+    return ESP_OK;
+}
+
+static httpd_uri_t togglecategory = {
+    .uri       = "/togglecategory",
+    .method    = HTTP_POST,
+    .handler   = togglecategory_handler,
+    .user_ctx  = NULL
+};
+
 esp_err_t updatefirmware_handler(httpd_req_t *req)
 {
     ESP_LOGI(TAG, "POST to %s", req->uri);
@@ -126,6 +195,229 @@ static httpd_uri_t updatefirmware = {
 };
 
 
+#define MAX_IP_BLACKLIST_SIZE 16384
+
+esp_err_t ipblacklist_post_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST to %s", req->uri);
+
+    if (req->content_len > MAX_IP_BLACKLIST_SIZE)
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "IP list too large")
+
+    std::string ranges(req->content_len, '\0');
+    size_t received = 0;
+    while( received < req->content_len )
+    {
+        int ret = httpd_req_recv(req, &ranges[received], req->content_len - received);
+        if( ret == HTTPD_SOCK_ERR_TIMEOUT )
+            continue;
+        if( ret <= 0 )
+            return ESP_FAIL;
+        received += ret;
+    }
+
+    esp_err_t err = save_ip_blacklist(ranges.c_str());
+    if( err == URL_ERR_INVALID_URL )
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid IP range")
+    else if( err != ESP_OK )
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error saving IP list")
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_send(req, NULL, 0 );
+    return ESP_OK;
+}
+
+static httpd_uri_t ipblacklist = {
+    .uri       = "/ipblacklist",
+    .method    = HTTP_POST,
+    .handler   = ipblacklist_post_handler,
+    .user_ctx  = NULL
+};
+
+
+#define MAX_GROUPS_SIZE 8192
+
+esp_err_t groups_post_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST to %s", req->uri);
+
+    if (req->content_len > MAX_GROUPS_SIZE)
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Group list too large")
+
+    std::string groups(req->content_len, '\0');
+    size_t received = 0;
+    while( received < req->content_len )
+    {
+        int ret = httpd_req_recv(req, &groups[received], req->content_len - received);
+        if( ret == HTTPD_SOCK_ERR_TIMEOUT )
+            continue;
+        if( ret <= 0 )
+            return ESP_FAIL;
+        received += ret;
+    }
+
+    esp_err_t err = save_policy_groups(groups.c_str());
+    if( err == URL_ERR_INVALID_URL )
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid group")
+    else if( err != ESP_OK )
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error saving groups")
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_send(req, NULL, 0 );
+    return ESP_OK;
+}
+
+static httpd_uri_t groups = {
+    .uri       = "/groups",
+    .method    = HTTP_POST,
+    .handler   = groups_post_handler,
+    .user_ctx  = NULL
+};
+#define MAX_SUBSCRIPTIONS_SIZE 4096
+
+esp_err_t subscriptions_post_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST to %s", req->uri);
+
+    if (req->content_len > MAX_SUBSCRIPTIONS_SIZE)
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Subscription list too large")
+
+    std::string urls(req->content_len, '\0');
+    size_t received = 0;
+    while( received < req->content_len )
+    {
+        int ret = httpd_req_recv(req, &urls[received], req->content_len - received);
+        if( ret == HTTPD_SOCK_ERR_TIMEOUT )
+            continue;
+        if( ret <= 0 )
+            return ESP_FAIL;
+        received += ret;
+    }
+
+    esp_err_t err = save_subscriptions(urls.c_str());
+    if( err == URL_ERR_INVALID_URL )
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid subscription URL")
+    else if( err != ESP_OK )
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error saving subscriptions")
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_send(req, NULL, 0 );
+    return ESP_OK;
+}
+
+static httpd_uri_t subscriptions = {
+    .uri       = "/subscriptions",
+    .method    = HTTP_POST,
+    .handler   = subscriptions_post_handler,
+    .user_ctx  = NULL
+};
+
+esp_err_t blacklist_image_post_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST to %s", req->uri);
+
+    esp_err_t err = begin_list_image_update(req->content_len);
+    if( err == ESP_ERR_NOT_FOUND )
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No blocklist partition")
+    else if( err != ESP_OK )
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Image too large")
+
+    // Stream image straight to flash
+    char buffer[1024];
+    size_t received = 0;
+    int timeouts = 0;
+    while( received < req->content_len )
+    {
+        int ret = httpd_req_recv(req, buffer, sizeof(buffer));
+        if( ret == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < MAX_RECV_TIMEOUTS )
+            continue;
+        if( ret <= 0 )
+            break;
+        if( write_list_image(buffer, ret) != ESP_OK )
+            break;
+        received += ret;
+    }
+
+    err = end_list_image_update();
+    if( received < req->content_len )
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error writing image")
+    if( err == ESP_ERR_NO_MEM )
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Not enough memory for image")
+    if( err != ESP_OK )
+        SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid image")
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_send(req, NULL, 0 );
+    return ESP_OK;
+}
+
+static httpd_uri_t blacklist_image = {
+    .uri       = "/blacklist/image",
+    .method    = HTTP_POST,
+    .handler   = blacklist_image_post_handler,
+    .user_ctx  = NULL
+};
+
+
+struct upload_reader {
+    httpd_req_t* req;
+    size_t remaining;
+};
+
+static int read_upload(char* buffer, size_t size, void* ctx)
+{
+    upload_reader* upload = (upload_reader*)ctx;
+    if( upload->remaining == 0 )
+        return 0;
+
+    int ret;
+    int timeouts = 0;
+    do {
+        ret = httpd_req_recv(upload->req, buffer, std::min(size, upload->remaining));
+    } while( ret == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < MAX_RECV_TIMEOUTS );
+    if( ret <= 0 )
+        return -1;
+
+    upload->remaining -= ret;
+    return ret;
+}
+
+esp_err_t blacklist_upload_post_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "POST to %s", req->uri);
+
+    // "?append=1" adds the list to blacklist.txt instead of replacing it
+    bool append = false;
+    char query[32] = {};
+    char param[8] = {};
+    if( httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK )
+        append = httpd_query_key_value(query, "append", param, sizeof(param)) != ESP_ERR_NOT_FOUND;
+
+    upload_reader upload = { req, req->content_len };
+    esp_err_t err = import_blacklist(read_upload, &upload, append);
+    if( err == ESP_ERR_NO_MEM )
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Not enough memory for list")
+    else if( err != ESP_OK )
+        SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error importing list")
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_send(req, NULL, 0 );
+    return ESP_OK;
+}
+
+static httpd_uri_t blacklist_upload = {
+    .uri       = "/blacklist/upload",
+    .method    = HTTP_POST,
+    .handler   = blacklist_upload_post_handler,
+    .user_ctx  = NULL
+};
+
+
 static void restartCallback(TimerHandle_t xTimer)
 {
     ESP_LOGI(TAG, "restarting");
@@ -156,8 +448,14 @@ esp_err_t register_post_handlers(httpd_handle_t server)
 {
     ATTEMPT(httpd_register_uri_handler(server, &settings))
     ATTEMPT(httpd_register_uri_handler(server, &toggleblock))
+    ATTEMPT(httpd_register_uri_handler(server, &togglecategory))
     ATTEMPT(httpd_register_uri_handler(server, &updatefirmware))
     ATTEMPT(httpd_register_uri_handler(server, &restart))
+    ATTEMPT(httpd_register_uri_handler(server, &ipblacklist))
+    ATTEMPT(httpd_register_uri_handler(server, &groups))
+    ATTEMPT(httpd_register_uri_handler(server, &blacklist_image))
+    ATTEMPT(httpd_register_uri_handler(server, &blacklist_upload))
+    ATTEMPT(httpd_register_uri_handler(server, &subscriptions))
 
     return ESP_OK;
 }
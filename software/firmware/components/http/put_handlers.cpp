@@ -30,8 +30,10 @@ esp_err_t blacklist_put_handler(httpd_req_t *req)
         return ESP_OK;
     }
 
+    // user_ctx selects the list
+    esp_err_t (*edit)(const char*) = (esp_err_t (*)(const char*))req->user_ctx;
     ESP_LOGD(TAG, "Adding %s", hostname);
-    esp_err_t err = add_to_blacklist(hostname); 
+    esp_err_t err = edit(hostname); 
     if( err == URL_ERR_INVALID_URL )
     {
         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid hostname");
@@ -53,13 +55,21 @@ static httpd_uri_t blacklistadd = {
     .uri       = "/blacklist/*",
     .method    = HTTP_PUT,
     .handler   = blacklist_put_handler,
-    .user_ctx  = NULL
+    .user_ctx  = (void*)add_to_blacklist
+};
+
+static httpd_uri_t allowlistadd = {
+    .uri       = "/allowlist/*",
+    .method    = HTTP_PUT,
+    .handler   = blacklist_put_handler,
+    .user_ctx  = (void*)add_to_allowlist
 };
 
 
 esp_err_t register_put_handlers(httpd_handle_t server)
 {
     ATTEMPT(httpd_register_uri_handler(server, &blacklistadd))
+    ATTEMPT(httpd_register_uri_handler(server, &allowlistadd))
 
     return ESP_OK;
 }
\ No newline at end of file
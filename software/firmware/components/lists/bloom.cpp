@@ -0,0 +1,79 @@
+#include "bloom.h"
+
+#define BLOCK_WORDS     8           // 64 byte blocks
+#define PROBES          6
+#define BITS_PER_ENTRY  9
+
+// Spread 32 bit hash over the 54 bits used for probes
+static inline uint64_t mix(uint32_t hash)
+{
+    uint64_t x = hash;
+    x ^= x >> 16;
+    x *= 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 32;
+    return x;
+}
+
+// Block is picked independently of the probe bits
+static inline size_t block_index(uint32_t hash, size_t blocks)
+{
+    return ((uint64_t)(uint32_t)(hash * 0x9E3779B1UL) * blocks) >> 32;
+}
+
+void bloom_filter::reset(size_t n, size_t max_bytes)
+{
+    size_t bytes = (n*BITS_PER_ENTRY + 7) / 8;
+    if( bytes > max_bytes )
+        bytes = max_bytes;
+
+    blocks = (bytes + BLOCK_WORDS*8 - 1) / (BLOCK_WORDS*8);
+    if( blocks == 0 )
+        blocks = 1;
+
+    bits.assign(blocks*BLOCK_WORDS, 0);
+    capacity = n;
+    entries = 0;
+}
+
+void bloom_filter::add(uint32_t hash)
+{
+    if( blocks == 0 )
+        return;
+
+    uint64_t h = mix(hash);
+    uint64_t* block = &bits[block_index(hash, blocks)*BLOCK_WORDS];
+    for( int i = 0; i < PROBES; i++ )
+    {
+        unsigned bit = (h >> (i*9)) & 0x1FF;
+        block[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    entries++;
+}
+
+static inline bool probe(const uint64_t* bits, size_t blocks, uint32_t hash)
+{
+    if( blocks == 0 )
+        return true;
+
+    uint64_t h = mix(hash);
+    const uint64_t* block = &bits[block_index(hash, blocks)*BLOCK_WORDS];
+    for( int i = 0; i < PROBES; i++ )
+    {
+        unsigned bit = (h >> (i*9)) & 0x1FF;
+        if( !(block[bit >> 6] & (1ULL << (bit & 63))) )
+            return false;
+    }
+    return true;
+}
+
+bool bloom_filter::possibly_contains(uint32_t hash) const
+{
+    return probe(bits.data(), blocks, hash);
+}
+
+bool bloom_view::possibly_contains(uint32_t hash) const
+{
+    return probe(bits, blocks, hash);
+}
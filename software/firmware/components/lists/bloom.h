@@ -0,0 +1,69 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+  * @brief Blocked Bloom filter over 32 bit suffix hashes
+  * 
+  * Every key sets all of its bits inside one 64 byte block, so a query 
+  * reads a single cache line. Used to skip full list lookups for names
+  * that are certainly not listed.
+  */
+class bloom_filter {
+        std::vector<uint64_t> bits;
+        size_t blocks;
+        size_t capacity;                // Entries the filter was sized for
+        size_t entries;
+    public:
+        bloom_filter() : blocks(0), capacity(0), entries(0) {}
+
+        /**
+          * @brief Clear filter and size it for entries at about 9 bits each
+          * 
+          * @param max_bytes upper bound on memory used, false positives increase above it
+          */
+        void reset(size_t entries, size_t max_bytes);
+
+        void add(uint32_t hash);
+
+        /**
+          * @brief Check hash, an empty filter matches everything
+          * 
+          * @return false if hash was certainly never added
+          */
+        bool possibly_contains(uint32_t hash) const;
+
+        bool full() const { return entries > capacity; }
+        size_t memory() const { return bits.capacity()*sizeof(uint64_t); }
+
+        /**
+          * @brief Filter blocks, to store the filter for a bloom_view
+          */
+        const uint64_t* data() const { return bits.data(); }
+        size_t block_count() const { return blocks; }
+};
+
+/**
+  * @brief Read only bloom_filter queried in place, from a memory mapped image
+  */
+class bloom_view {
+        const uint64_t* bits;
+        size_t blocks;
+    public:
+        bloom_view() : bits(NULL), blocks(0) {}
+
+        /**
+          * @param data blocks of a bloom_filter, 8 byte aligned
+          */
+        void assign(const void* data, size_t blocks_) { bits = (const uint64_t*)data; blocks = blocks_; }
+
+        /**
+          * @brief Check hash, an empty view matches everything
+          */
+        bool possibly_contains(uint32_t hash) const;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "default_list.h"
+#include <string.h>
+
+struct default_slot {
+    uint32_t hash;                  // domain_hash() of name
+    const char* name;
+    int16_t exact_rule;             // Rule for name itself, -1 if none
+    int16_t subdomain_rule;         // Rule for names below it, -1 if none
+};
+
+struct default_pattern {
+    const char* const* segments;    // Literal parts between '*', may contain '?'
+    uint8_t count;
+    bool anchored_start;            // Pattern doesn't start with '*'
+    bool anchored_end;              // Pattern doesn't end with '*'
+    int16_t rule;
+};
+
+#include "default_rules.h"          // Generated at build time
+
+
+size_t default_rule_count()
+{
+    return DEFAULT_RULES;
+}
+
+const char* default_rule(size_t rule)
+{
+    return rule < DEFAULT_RULES ? default_rule_text[rule] : NULL;
+}
+
+// Slot of hash, displaced per bucket so every rule's name has its own slot
+static inline uint32_t slot_of(uint32_t hash)
+{
+    uint32_t h = hash ^ (uint32_t)(default_displacements[hash % DEFAULT_BUCKETS] * 0x9E3779B1UL);
+    h ^= h >> 16;
+    h *= 0x85EBCA6BUL;
+    h ^= h >> 13;
+    return h % DEFAULT_SLOTS;
+}
+
+static const default_slot* find_slot(uint32_t hash, const char* name, size_t len)
+{
+    if( DEFAULT_SLOTS == 0 )
+        return NULL;
+
+    const default_slot* slot = &default_slots[slot_of(hash)];
+    if( slot->hash != hash || strncmp(slot->name, name, len) != 0 || slot->name[len] != '\0' )
+        return NULL;
+    return slot;
+}
+
+int find_default_domain(const char* name, size_t len, uint8_t flag)
+{
+    const default_slot* slot = find_slot(domain_hash(name, len), name, len);
+    if( slot == NULL )
+        return -1;
+    return (flag == MATCH_EXACT) ? slot->exact_rule : (flag == MATCH_SUBDOMAINS) ? slot->subdomain_rule : -1;
+}
+
+int find_default_pattern(const char* pattern)
+{
+    for( size_t i = 0; i < DEFAULT_PATTERNS; i++ )
+    {
+        if( strcmp(default_rule_text[default_patterns[i].rule], pattern) == 0 )
+            return default_patterns[i].rule;
+    }
+    return -1;
+}
+
+static inline bool enabled_rule(const std::vector<bool>* enabled, int rule)
+{
+    return rule >= 0 && (enabled == NULL || ((size_t)rule < enabled->size() && (*enabled)[rule]));
+}
+
+static bool segment_at(const char* name, const char* segment, size_t len)
+{
+    for( size_t i = 0; i < len; i++ )
+    {
+        if( segment[i] != '?' && segment[i] != name[i] )
+            return false;
+    }
+    return true;
+}
+
+// Segments are matched in order, each at its leftmost position after the previous one,
+// the first and last are pinned to the ends of name unless the pattern has a '*' there
+static bool pattern_match(const default_pattern& pattern, const char* name, size_t len)
+{
+    size_t pos = 0;
+    for( size_t i = 0; i < pattern.count; i++ )
+    {
+        const char* segment = pattern.segments[i];
+        size_t n = strlen(segment);
+        bool first = (i == 0) && pattern.anchored_start;
+        bool last = (i + 1 == (size_t)pattern.count) && pattern.anchored_end;
+
+        if( last )
+            return len - pos >= n && (!first || len == n) && segment_at(name + len - n, segment, n);
+        if( first )
+        {
+            if( len < n || !segment_at(name, segment, n) )
+                return false;
+            pos = n;
+            continue;
+        }
+
+        while( pos + n <= len && !segment_at(name + pos, segment, n) )
+            pos++;
+        if( pos + n > len )
+            return false;
+        pos += n;
+    }
+    return !pattern.anchored_end || pos == len;
+}
+
+int match_default_rules(const domain_key& key, const std::vector<bool>* enabled)
+{
+    // Name and each of its parents from the TLD down, parents only match subdomain rules
+    for( size_t i = key.labels; i-- > 0; )
+    {
+        const char* suffix = key.name + key.starts[i];
+        const default_slot* slot = find_slot(key.hashes[i], suffix, key.len - key.starts[i]);
+        if( slot != NULL )
+        {
+            int rule = (i == 0) ? slot->exact_rule : slot->subdomain_rule;
+            if( enabled_rule(enabled, rule) )
+                return rule;
+        }
+    }
+
+    for( size_t i = 0; i < DEFAULT_PATTERNS && key.len > 0; i++ )
+    {
+        if( enabled_rule(enabled, default_patterns[i].rule) && pattern_match(default_patterns[i], key.name, key.len) )
+            return default_patterns[i].rule;
+    }
+    return -1;
+}
@@ -0,0 +1,48 @@
+#ifndef DEFAULT_LIST_H
+#define DEFAULT_LIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "domain_index.h"
+
+/**
+  * Rules of defaultblacklist.txt, compiled into constant tables by gen_default_rules.py
+  * 
+  * Domain rules are in a minimal perfect hash table, a name and each of its parents
+  * take one probe each. Patterns are split into their literal segments at build time.
+  * The tables are in flash, lookups use no RAM and don't need the filesystem.
+  * Rules are numbered in the order of defaultblacklist.txt
+  */
+
+size_t default_rule_count();
+
+/**
+  * @brief Rule as written in blacklist.txt
+  */
+const char* default_rule(size_t rule);
+
+/**
+  * @brief Find default rule for normalized name with MATCH_EXACT or MATCH_SUBDOMAINS
+  *
+  * @return rule number, -1 if it isn't a default rule
+  */
+int find_default_domain(const char* name, size_t len, uint8_t flag);
+
+/**
+  * @brief Find default rule with pattern as its text
+  *
+  * @return rule number, -1 if it isn't a default rule
+  */
+int find_default_pattern(const char* pattern);
+
+/**
+  * @brief First enabled default rule blocking key's name
+  *
+  * @param enabled flag for each rule, NULL if every rule is enabled
+  *
+  * @return rule number, -1 if name is not blocked
+  */
+int match_default_rules(const domain_key& key, const std::vector<bool>* enabled);
+
+#endif
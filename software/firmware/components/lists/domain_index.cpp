@@ -0,0 +1,689 @@
+#include "domain_index.h"
+#include <string.h>
+
+#define EMPTY       0xFFFFFFFF      // Slot that was never used
+#define ERASED      0xFFFFFFFE      // Slot whose node was removed
+#define ROOT        0xFFFFFFFF      // Parent of top level labels
+#define MIN_SLOTS   64
+
+
+uint32_t label_hash(const char* label, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261UL;
+    for( size_t i = 0; i < len; i++ )
+    {
+        hash ^= (uint8_t)label[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+uint32_t domain_hash(const char* domain, size_t len)
+{
+    uint32_t hash = ROOT_HASH;
+    size_t end = len;
+    while( true )
+    {
+        size_t start = end;
+        while( start > 0 && domain[start-1] != '.' )
+            start--;
+
+        hash = suffix_hash(hash, label_hash(domain + start, end - start));
+        if( start == 0 )
+            return hash;
+        end = start - 1;
+    }
+}
+
+size_t normalize_domain(const char* domain, char* out)
+{
+    size_t len = 0;
+    for( ; domain[len] != '\0'; len++ )
+    {
+        char c = domain[len];
+        out[len] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    while( len > 0 && out[len-1] == '.' )
+        len--;
+
+    out[len] = '\0';
+    return len;
+}
+
+// Lowercase the bytes of w that are 'A' to 'Z', others are unchanged
+static inline uint32_t lowercase_word(uint32_t w)
+{
+    uint32_t low = w & 0x7F7F7F7FUL;
+    uint32_t from_a = low + 0x3F3F3F3FUL;   // Bit 7 set in bytes >= 'A'
+    uint32_t past_z = low + 0x25252525UL;   // Bit 7 set in bytes > 'Z'
+    uint32_t upper = from_a & ~past_z & ~w & 0x80808080UL;
+    return w | (upper >> 2);
+}
+
+static inline uint32_t hash_byte(uint32_t hash, uint8_t c)
+{
+    return (hash ^ c) * 16777619UL;
+}
+
+static bool empty_key(domain_key* key)
+{
+    key->len = 0;
+    key->labels = 0;
+    key->name[0] = '\0';
+    return false;
+}
+
+// Turn label hashes of key into suffix hashes, from the TLD down
+static void suffix_hashes(domain_key* key)
+{
+    uint32_t hash = ROOT_HASH;
+    for( size_t i = key->labels; i-- > 0; )
+    {
+        hash = suffix_hash(hash, key->hashes[i]);
+        key->hashes[i] = hash;
+    }
+}
+
+bool wire_domain_key(const uint8_t* wire, size_t size, domain_key* key)
+{
+    key->len = 0;
+    key->labels = 0;
+    uint32_t dots = 0;                      // Nonzero if a label contains '.'
+    size_t i = 0;
+    while( i < size && wire[i] != 0 )
+    {
+        size_t len = wire[i++];
+        size_t dot = key->labels > 0 ? 1 : 0;
+        if( (len & 0xC0) != 0 || i + len > size || key->labels == MAX_LABELS || key->len + dot + len > MAX_NAME_LENGTH )
+            return empty_key(key);
+
+        if( dot )
+            key->name[key->len++] = '.';
+        key->starts[key->labels] = key->len;
+
+        // FNV-1a of the lowercased label, same as label_hash()
+        const uint8_t* in = wire + i;
+        char* out = key->name + key->len;
+        uint32_t hash = 2166136261UL;
+        size_t n = 0;
+        for( ; n + 4 <= len; n += 4 )
+        {
+            uint32_t w;
+            memcpy(&w, in + n, 4);
+            w = lowercase_word(w);
+            memcpy(out + n, &w, 4);
+            uint32_t x = w ^ 0x2E2E2E2EUL;
+            dots |= (x - 0x01010101UL) & ~x & 0x80808080UL;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            w = __builtin_bswap32(w);
+#endif
+            for( int b = 0; b < 4; b++, w >>= 8 )
+                hash = hash_byte(hash, w & 0xFF);
+        }
+        for( ; n < len; n++ )
+        {
+            uint8_t c = in[n];
+            out[n] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+            hash = hash_byte(hash, out[n]);
+            dots |= (out[n] == '.');
+        }
+
+        key->hashes[key->labels++] = hash;
+        key->len += len;
+        i += len;
+    }
+    if( i >= size )
+        return empty_key(key);
+
+    key->name[key->len] = '\0';
+
+    // Labels of the dotted name aren't the wire labels, hash it like any other name
+    if( dots != 0 )
+        return make_domain_key(key->name, key);
+    suffix_hashes(key);
+    return true;
+}
+
+bool make_domain_key(const char* domain, domain_key* key)
+{
+    if( strlen(domain) > MAX_NAME_LENGTH )
+        return empty_key(key);
+
+    key->len = normalize_domain(domain, key->name);
+    key->labels = 0;
+    size_t start = 0;
+    for( size_t i = 0; i <= key->len && key->len > 0; i++ )
+    {
+        if( i < key->len && key->name[i] != '.' )
+            continue;
+        if( key->labels == MAX_LABELS )
+            return empty_key(key);
+        key->starts[key->labels] = start;
+        key->hashes[key->labels++] = label_hash(key->name + start, i - start);
+        start = i + 1;
+    }
+    suffix_hashes(key);
+    return true;
+}
+
+size_t reverse_labels(const char* domain, size_t len, char* out)
+{
+    size_t written = 0;
+    size_t end = len;
+    while( true )
+    {
+        size_t start = end;
+        while( start > 0 && domain[start-1] != '.' )
+            start--;
+
+        memcpy(out + written, domain + start, end - start);
+        written += end - start;
+        if( start == 0 )
+            break;
+        out[written++] = '.';
+        end = start - 1;
+    }
+    return written;
+}
+
+static inline uint16_t fingerprint(uint32_t hash)
+{
+    return hash >> 16;
+}
+
+// Walks the labels of a domain from right to left
+class label_iterator {
+        const char* domain;
+        size_t end;
+    public:
+        const char* label;
+        size_t len;
+
+        label_iterator(const char* domain_, size_t len_)
+        : domain(domain_), end(len_), label(NULL), len(0) {}
+
+        bool next()
+        {
+            if( label == domain )
+                return false;
+
+            size_t start = end;
+            while( start > 0 && domain[start-1] != '.' )
+                start--;
+
+            label = domain + start;
+            len = end - start;
+            end = start > 0 ? start - 1 : 0;
+            return true;
+        }
+
+        bool last() const { return label == domain; }
+};
+
+
+domain_index::domain_index()
+: count(0), used(0), dead(0) {}
+
+domain_index::domain_index(const domain_index& other)
+: count(0), used(0), dead(0)
+{
+    *this = other;
+}
+
+domain_index& domain_index::operator=(const domain_index& other)
+{
+    if( this == &other )
+        return *this;
+
+    fingerprints = other.fingerprints;
+    slots = other.slots;
+    nodes = other.nodes;
+    hits.resize(other.hits.size());
+    for( size_t i = 0; i < hits.size(); i++ )
+        hits[i] = read_hits(&other.hits[i]);
+    allow_lists = other.allow_lists;
+    labels = other.labels;
+    count = other.count;
+    used = other.used;
+    dead = other.dead;
+    return *this;
+}
+
+uint32_t domain_index::find_child(uint32_t parent, uint32_t hash, const char* label, size_t len) const
+{
+    if( slots.empty() )
+        return NO_MATCH;
+
+    size_t mask = slots.size() - 1;
+    uint16_t fp = fingerprint(hash);
+    for( size_t i = hash & mask; slots[i] != EMPTY; i = (i + 1) & mask )
+    {
+        if( fingerprints[i] == fp && slots[i] != ERASED )
+        {
+            const node& n = nodes[slots[i]];
+            if( n.parent == parent && n.len == len && memcmp(labels.data() + n.label, label, len) == 0 )
+                return slots[i];
+        }
+    }
+    return NO_MATCH;
+}
+
+uint32_t domain_index::add_child(uint32_t parent, uint32_t hash, const char* label, size_t len)
+{
+    if( (used + 1)*4 > slots.size()*3 )
+        grow();
+
+    node n;
+    n.parent = parent;
+    n.label = labels.size();
+    n.len = len;
+    n.flags = 0;
+    n.children = 0;
+    n.exact_lists = 0;
+    n.subdomain_lists = 0;
+    labels.append(label, len);
+    nodes.push_back(n);
+    hits.push_back(0);
+    if( parent != ROOT )
+        nodes[parent].children++;
+
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while( slots[i] != EMPTY && slots[i] != ERASED )
+        i = (i + 1) & mask;
+
+    if( slots[i] == EMPTY )
+        used++;
+    fingerprints[i] = fingerprint(hash);
+    slots[i] = nodes.size() - 1;
+    return slots[i];
+}
+
+uint32_t domain_index::find_node(const char* domain, size_t len) const
+{
+    if( len == 0 )
+        return NO_MATCH;
+
+    uint32_t id = ROOT;
+    uint32_t hash = ROOT_HASH;
+    label_iterator it(domain, len);
+    while( it.next() )
+    {
+        hash = suffix_hash(hash, label_hash(it.label, it.len));
+        id = find_child(id, hash, it.label, it.len);
+        if( id == NO_MATCH )
+            break;
+    }
+    return id;
+}
+
+// Rehash once 3/4 of the slots are used, into a table at most half full.
+// Erased slots are dropped, so the table only grows if nodes were added
+void domain_index::grow()
+{
+    size_t live = 0;
+    for( size_t i = 0; i < slots.size(); i++ )
+    {
+        if( slots[i] != EMPTY && slots[i] != ERASED )
+            live++;
+    }
+
+    size_t size = MIN_SLOTS;
+    while( (live + 1)*2 > size )
+        size *= 2;
+
+    std::vector<uint32_t> old_slots;
+    old_slots.swap(slots);
+    fingerprints.assign(size, 0);
+    slots.assign(size, EMPTY);
+    used = 0;
+
+    // Nodes are rehashed parents first, so each parent's hash is known when its children are reached
+    std::vector<uint32_t> hashes(nodes.size(), 0);
+    std::vector<bool> live_nodes(nodes.size(), false);
+    for( size_t i = 0; i < old_slots.size(); i++ )
+    {
+        if( old_slots[i] != EMPTY && old_slots[i] != ERASED )
+            live_nodes[old_slots[i]] = true;
+    }
+
+    size_t mask = size - 1;
+    for( uint32_t id = 0; id < nodes.size(); id++ )
+    {
+        if( !live_nodes[id] )
+            continue;
+
+        const node& n = nodes[id];
+        uint32_t parent_hash = n.parent == ROOT ? ROOT_HASH : hashes[n.parent];
+        uint32_t hash = suffix_hash(parent_hash, label_hash(labels.data() + n.label, n.len));
+        hashes[id] = hash;
+
+        size_t j = hash & mask;
+        while( slots[j] != EMPTY )
+            j = (j + 1) & mask;
+
+        fingerprints[j] = fingerprint(hash);
+        slots[j] = id;
+        used++;
+    }
+}
+
+bool domain_index::insert(const char* domain, size_t len, uint8_t flags, uint16_t lists)
+{
+    if( len == 0 || flags == 0 || lists == 0 )
+        return false;
+
+    label_iterator check(domain, len);
+    while( check.next() )
+    {
+        if( check.len == 0 || check.len > 0xFF )
+            return false;
+    }
+
+    uint32_t id = ROOT;
+    uint32_t hash = ROOT_HASH;
+    label_iterator it(domain, len);
+    while( it.next() )
+    {
+        hash = suffix_hash(hash, label_hash(it.label, it.len));
+        uint32_t child = find_child(id, hash, it.label, it.len);
+        id = (child == NO_MATCH) ? add_child(id, hash, it.label, it.len) : child;
+    }
+
+    if( id == ROOT )
+        return false;
+
+    node& n = nodes[id];
+    uint16_t exact_lists = n.exact_lists | ((flags & MATCH_EXACT) ? lists : 0);
+    uint16_t subdomain_lists = n.subdomain_lists | ((flags & MATCH_SUBDOMAINS) ? lists : 0);
+    bool allow_changed = false;
+    if( flags & (ALLOW_EXACT | ALLOW_SUBDOMAINS) )
+    {
+        uint32_t& owners = allow_lists[id];
+        uint32_t added = ((flags & ALLOW_EXACT) ? lists : 0) | ((flags & ALLOW_SUBDOMAINS) ? (uint32_t)lists << 16 : 0);
+        allow_changed = (owners | added) != owners;
+        owners |= added;
+    }
+    if( (n.flags & flags) == flags && exact_lists == n.exact_lists && subdomain_lists == n.subdomain_lists && !allow_changed )
+        return false;
+
+    if( n.flags == 0 )
+        count++;
+    n.flags |= flags;
+    n.exact_lists = exact_lists;
+    n.subdomain_lists = subdomain_lists;
+    return true;
+}
+
+uint32_t domain_index::node_hash(uint32_t id) const
+{
+    uint32_t path[128];
+    size_t depth = 0;
+    for( ; id != ROOT && depth < 128; id = nodes[id].parent )
+        path[depth++] = id;
+
+    uint32_t hash = ROOT_HASH;
+    while( depth > 0 )
+    {
+        const node& n = nodes[path[--depth]];
+        hash = suffix_hash(hash, label_hash(labels.data() + n.label, n.len));
+    }
+    return hash;
+}
+
+// Drop node from table, and any parents that are left without entries or children
+void domain_index::remove_node(uint32_t id)
+{
+    size_t mask = slots.size() - 1;
+    while( id != ROOT && nodes[id].flags == 0 && nodes[id].children == 0 )
+    {
+        for( size_t i = node_hash(id) & mask; slots[i] != EMPTY; i = (i + 1) & mask )
+        {
+            if( slots[i] == id )
+            {
+                slots[i] = ERASED;
+                break;
+            }
+        }
+
+        uint32_t parent = nodes[id].parent;
+        if( parent != ROOT )
+            nodes[parent].children--;
+        dead++;
+        id = parent;
+    }
+}
+
+bool domain_index::erase(const char* domain, size_t len, uint8_t flags, uint16_t lists)
+{
+    uint32_t id = find_node(domain, len);
+    if( id == NO_MATCH || id == ROOT || (nodes[id].flags & flags) == 0 )
+        return false;
+
+    // Other lists keep their entry for the same name
+    node& n = nodes[id];
+    uint16_t exact_lists = (flags & MATCH_EXACT) ? n.exact_lists & ~lists : n.exact_lists;
+    uint16_t subdomain_lists = (flags & MATCH_SUBDOMAINS) ? n.subdomain_lists & ~lists : n.subdomain_lists;
+    bool changed = exact_lists != n.exact_lists || subdomain_lists != n.subdomain_lists;
+    n.exact_lists = exact_lists;
+    n.subdomain_lists = subdomain_lists;
+    uint8_t cleared = (exact_lists == 0 ? MATCH_EXACT : 0) | (subdomain_lists == 0 ? MATCH_SUBDOMAINS : 0);
+
+    std::map<uint32_t, uint32_t>::iterator owners = allow_lists.find(id);
+    if( owners != allow_lists.end() )
+    {
+        uint32_t removed = ((flags & ALLOW_EXACT) ? lists : 0) | ((flags & ALLOW_SUBDOMAINS) ? (uint32_t)lists << 16 : 0);
+        changed |= (owners->second & removed) != 0;
+        owners->second &= ~removed;
+        cleared |= ((owners->second & 0xFFFF) == 0 ? ALLOW_EXACT : 0) | ((owners->second >> 16) == 0 ? ALLOW_SUBDOMAINS : 0);
+        if( owners->second == 0 )
+            allow_lists.erase(owners);
+    }
+    if( !changed )
+        return false;
+
+    nodes[id].flags &= ~(flags & cleared);
+    if( nodes[id].flags == 0 )
+        hits[id] = 0;
+    if( nodes[id].flags == 0 )
+    {
+        count--;
+        remove_node(id);
+    }
+    return true;
+}
+
+uint16_t domain_index::match(const char* domain, size_t len, bool* allowed, uint32_t* entry) const
+{
+    uint16_t lists = 0;
+    bool allow = false;
+    uint32_t decided = NO_MATCH;
+    if( entry != NULL )
+        *entry = NO_MATCH;
+    if( len == 0 )
+        return lists;
+
+    // Block entries of every ancestor add up, an allow entry drops those 
+    // above it and its own name's block entries
+    uint32_t id = ROOT;
+    uint32_t hash = ROOT_HASH;
+    label_iterator it(domain, len);
+    while( it.next() )
+    {
+        hash = suffix_hash(hash, label_hash(it.label, it.len));
+        id = find_child(id, hash, it.label, it.len);
+        if( id == NO_MATCH )
+            break;
+        match_node(id, it.last(), &lists, &allow, &decided);
+    }
+
+    if( allowed != NULL )
+        *allowed = allow;
+    if( entry != NULL )
+        *entry = decided;
+    return lists;
+}
+
+uint16_t domain_index::match(const domain_key& key, bool* allowed, uint32_t* entry) const
+{
+    uint16_t lists = 0;
+    bool allow = false;
+    uint32_t decided = NO_MATCH;
+
+    uint32_t id = ROOT;
+    for( size_t i = key.labels; i-- > 0; )
+    {
+        id = find_child(id, key.hashes[i], key.name + key.starts[i], key.label_len(i));
+        if( id == NO_MATCH )
+            break;
+        match_node(id, i == 0, &lists, &allow, &decided);
+    }
+
+    if( allowed != NULL )
+        *allowed = allow;
+    if( entry != NULL )
+        *entry = decided;
+    return lists;
+}
+
+// Apply entry of node on the walk down to a name, last if it is the name itself
+void domain_index::match_node(uint32_t id, bool last, uint16_t* lists, bool* allow, uint32_t* decided) const
+{
+    const node& n = nodes[id];
+    if( n.flags & (last ? ALLOW_EXACT : ALLOW_SUBDOMAINS) )
+    {
+        *lists = 0;
+        *allow = true;
+        *decided = id;
+    }
+    else
+    {
+        uint16_t block = last ? n.exact_lists : n.subdomain_lists;
+        if( block != 0 )
+        {
+            *lists |= block;
+            *allow = false;
+            *decided = id;
+        }
+    }
+}
+
+// Parents are always added before their children and outlive them, so a parent's
+// new id is known by the time its children are reached
+void domain_index::compact()
+{
+    if( dead == 0 )
+        return;
+
+    std::vector<bool> live(nodes.size(), false);
+    for( size_t i = 0; i < slots.size(); i++ )
+    {
+        if( slots[i] != EMPTY && slots[i] != ERASED )
+            live[slots[i]] = true;
+    }
+
+    std::vector<uint32_t> ids(nodes.size(), NO_MATCH);
+    std::vector<node> kept_nodes;
+    std::vector<uint32_t> kept_hits;
+    std::string kept_labels;
+    kept_nodes.reserve(nodes.size() - dead);
+    kept_hits.reserve(nodes.size() - dead);
+    for( uint32_t id = 0; id < nodes.size(); id++ )
+    {
+        if( !live[id] )
+            continue;
+
+        node n = nodes[id];
+        n.parent = n.parent == ROOT ? ROOT : ids[n.parent];
+        n.label = kept_labels.size();
+        kept_labels.append(labels, nodes[id].label, n.len);
+        ids[id] = kept_nodes.size();
+        kept_nodes.push_back(n);
+        kept_hits.push_back(read_hits(&hits[id]));
+    }
+
+    std::map<uint32_t, uint32_t> kept_allow;
+    for( std::map<uint32_t, uint32_t>::iterator it = allow_lists.begin(); it != allow_lists.end(); it++ )
+        kept_allow[ids[it->first]] = it->second;
+
+    for( size_t i = 0; i < slots.size(); i++ )
+    {
+        if( slots[i] != EMPTY && slots[i] != ERASED )
+            slots[i] = ids[slots[i]];
+    }
+    nodes.swap(kept_nodes);
+    hits.swap(kept_hits);
+    labels.swap(kept_labels);
+    allow_lists.swap(kept_allow);
+    dead = 0;
+
+    // Erased slots go too
+    grow();
+}
+
+void domain_index::for_each_hash(hash_callback fn, void* ctx) const
+{
+    for( uint32_t id = 0; id < nodes.size(); id++ )
+    {
+        if( nodes[id].flags != 0 )
+            fn(node_hash(id), ctx);
+    }
+}
+
+// Name of node, parents hold the labels following its own
+size_t domain_index::node_name(uint32_t id, char* name) const
+{
+    size_t len = 0;
+    for( uint32_t p = id; p != ROOT && len + nodes[p].len + 1 <= 256; p = nodes[p].parent )
+    {
+        if( len > 0 )
+            name[len++] = '.';
+        memcpy(name + len, labels.data() + nodes[p].label, nodes[p].len);
+        len += nodes[p].len;
+    }
+    return len;
+}
+
+void domain_index::for_each_hit(void (*fn)(uint32_t entry, uint32_t hits, void* ctx), void* ctx) const
+{
+    for( uint32_t id = 0; id < nodes.size(); id++ )
+    {
+        if( nodes[id].flags != 0 )
+            fn(id, read_hits(&hits[id]), ctx);
+    }
+}
+
+size_t domain_index::entry_name(uint32_t entry, char* name, uint8_t* flags) const
+{
+    *flags = entry < nodes.size() ? nodes[entry].flags : 0;
+    if( *flags == 0 )
+        return 0;
+    return node_name(entry, name);
+}
+
+size_t domain_index::memory() const
+{
+    return fingerprints.capacity()*sizeof(uint16_t) + slots.capacity()*sizeof(uint32_t) + 
+           nodes.capacity()*sizeof(node) + hits.capacity()*sizeof(uint32_t) + labels.capacity() +
+           allow_lists.size()*(2*sizeof(uint32_t) + 4*sizeof(void*));
+}
+
+void domain_index::clear()
+{
+    fingerprints.clear();
+    slots.clear();
+    nodes.clear();
+    hits.clear();
+    allow_lists.clear();
+    labels.clear();
+    fingerprints.shrink_to_fit();
+    slots.shrink_to_fit();
+    nodes.shrink_to_fit();
+    hits.shrink_to_fit();
+    labels.shrink_to_fit();
+    count = 0;
+    used = 0;
+    dead = 0;
+}
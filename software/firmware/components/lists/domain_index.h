@@ -0,0 +1,262 @@
+#ifndef DOMAIN_INDEX_H
+#define DOMAIN_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#define MATCH_EXACT         0x01    // Entry matches the domain itself
+#define MATCH_SUBDOMAINS    0x02    // Entry matches every domain below it
+#define ALLOW_EXACT         0x04    // Allowlist entry for the domain itself
+#define ALLOW_SUBDOMAINS    0x08    // Allowlist entry for every domain below it
+#define NO_MATCH            0xFFFFFFFF
+#define ALL_LISTS           0xFFFF  // Every list bit, see insert()
+#define MAX_NAME_LENGTH     255     // Longest name in dotted form
+#define MAX_LABELS          128     // Labels of the longest name
+
+/**
+  * @brief Hash of a single label
+  */
+uint32_t label_hash(const char* label, size_t len);
+
+/**
+  * @brief Hash of a suffix, from the hash of its parent suffix and its first label
+  * 
+  * Hash of "example.com" is suffix_hash(suffix_hash(ROOT_HASH, label_hash("com")), label_hash("example"))
+  */
+static inline uint32_t suffix_hash(uint32_t parent, uint32_t label)
+{
+    uint32_t hash = (parent ^ label) * 0x9E3779B1UL;
+    return hash ^ (hash >> 15);
+}
+
+#define ROOT_HASH 0x811C9DC5UL
+
+typedef void (*hash_callback)(uint32_t hash, void* ctx);
+typedef void (*name_callback)(const char* name, size_t len, uint8_t flags, void* ctx);
+
+/**
+  * @brief Suffix hash of a whole domain, as passed to hash_callback
+  */
+uint32_t domain_hash(const char* domain, size_t len);
+
+/**
+  * @brief Add a hit to a rule counter, relaxed so counting never waits for other counters
+  */
+static inline void count_hit(uint32_t* counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t read_hits(const uint32_t* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+  * @brief Lowercase domain and strip trailing '.'
+  *
+  * @param domain domain to normalize
+  * @param out buffer of at least strlen(domain)+1 bytes
+  *
+  * @return length of normalized domain
+  */
+size_t normalize_domain(const char* domain, char* out);
+
+/**
+  * @brief Normalized name with the suffix hash of the name and each of its parents
+  * 
+  * Made once per query and passed to every lookup, so the name isn't 
+  * lowercased or hashed again by each of them
+  */
+struct domain_key {
+    char name[MAX_NAME_LENGTH+1];       // Lowercase, without trailing '.'
+    size_t len;
+    size_t labels;
+    uint8_t starts[MAX_LABELS];         // Offset of each label in name, leftmost first
+    uint32_t hashes[MAX_LABELS];        // Suffix hash of name+starts[i], hashes[0] is domain_hash(name)
+
+    size_t label_len(size_t i) const
+    {
+        return (i + 1 < labels ? starts[i+1] - 1 : len) - starts[i];
+    }
+};
+
+/**
+  * @brief Make key of a name in DNS wire format, in a single pass over the name
+  * 
+  * Labels are copied and lowercased a word at a time, each label is hashed
+  * while it is copied
+  *
+  * @param wire length prefixed labels ending with the root label
+  * @param size bytes available at wire
+  *
+  * @return
+  *     - true Key made
+  *     - false Name is truncated, too long or compressed, key is empty
+  */
+bool wire_domain_key(const uint8_t* wire, size_t size, domain_key* key);
+
+/**
+  * @brief Make key of a domain in dotted form
+  *
+  * @return
+  *     - true Key made
+  *     - false Domain is too long, key is empty
+  */
+bool make_domain_key(const char* domain, domain_key* key);
+
+/**
+  * @brief Reverse order of labels, "a.b.c" -> "c.b.a"
+  *
+  * @param out buffer of at least len bytes
+  *
+  * @return length of reversed domain, always len
+  */
+size_t reverse_labels(const char* domain, size_t len, char* out);
+
+/**
+  * @brief Blocklist of domains stored as a trie of reversed labels
+  * 
+  * "ads.example.com" is stored as com -> example -> ads, parents are shared
+  * between all of their children and a lookup walks down from the TLD, 
+  * so the most specific listed ancestor of a name is found in one pass.
+  * 
+  * Trie edges are kept in an open addressing hash table keyed by the 
+  * suffix hash of the child. Every slot holds a 16 bit fingerprint of the
+  * hash in one array and the node id in another, so a probe only touches 
+  * the node when the fingerprint already matches. Names must be normalized.
+  * 
+  */
+class domain_index {
+        struct node {
+            uint32_t parent;
+            uint32_t label;                 // Offset of label in labels
+            uint8_t len;
+            uint8_t flags;                  // MATCH_* flags of entry ending at this node
+            uint16_t children;
+            uint16_t exact_lists;           // Lists with a MATCH_EXACT entry for this node
+            uint16_t subdomain_lists;       // Lists with a MATCH_SUBDOMAINS entry for this node
+        };
+        std::vector<uint16_t> fingerprints;
+        std::vector<uint32_t> slots;        // Node ids
+        std::vector<node> nodes;
+        mutable std::vector<uint32_t> hits; // Matches of each node's entries, parallel to nodes
+        std::map<uint32_t, uint32_t> allow_lists;   // Lists of each allow entry, ALLOW_EXACT in the low half
+        std::string labels;
+        size_t count;                       // Entries in index
+        size_t used;                        // Slots in use, including erased ones
+        size_t dead;                        // Removed nodes, kept with their labels until compacted
+
+        uint32_t find_child(uint32_t parent, uint32_t hash, const char* label, size_t len) const;
+        uint32_t add_child(uint32_t parent, uint32_t hash, const char* label, size_t len);
+        uint32_t find_node(const char* domain, size_t len) const;
+        uint32_t node_hash(uint32_t id) const;
+        size_t node_name(uint32_t id, char* name) const;
+        void remove_node(uint32_t id);
+        void match_node(uint32_t id, bool last, uint16_t* lists, bool* allow, uint32_t* decided) const;
+        void grow();
+    public:
+        domain_index();
+
+        /**
+          * @brief Copy, hit counts are read as matches of the copied index may update them
+          */
+        domain_index(const domain_index& other);
+        domain_index& operator=(const domain_index& other);
+
+        /**
+          * @brief Add entry, flags are combined with those of an existing entry
+          *
+          * @param lists bitmask of the lists the block entry comes from, one bit per
+          *              list. Allowlist entries apply to every list
+          *
+          * @return
+          *     - true Entry added or flags changed
+          *     - false Entry already in index
+          */
+        bool insert(const char* domain, size_t len, uint8_t flags, uint16_t lists = ALL_LISTS);
+
+        /**
+          * @brief Remove an entry from lists, flags are only cleared once no list has them
+          *
+          * @return
+          *     - true Entry changed
+          *     - false Entry not in any of the lists
+          */
+        bool erase(const char* domain, size_t len, uint8_t flags, uint16_t lists = ALL_LISTS);
+
+        /**
+          * @brief Find the lists blocking domain
+          * 
+          * Block and allow entries are found in the same walk. An allowlist entry
+          * overrides block entries of less specific names and wins over block 
+          * entries for the same name
+          *
+          * @param allowed set to whether domain is covered by an allowlist entry
+          * @param entry set to the id of the most specific entry deciding the result, 
+          *              NO_MATCH if no entry applies
+          *
+          * @return bitmask of the lists blocking domain, 0 if it is not blocked
+          */
+        uint16_t match(const char* domain, size_t len, bool* allowed = NULL, uint32_t* entry = NULL) const;
+
+        /**
+          * @brief Same as match(), with the hashes of key instead of hashing its name again
+          */
+        uint16_t match(const domain_key& key, bool* allowed = NULL, uint32_t* entry = NULL) const;
+
+        /**
+          * @brief Count a hit of entry from match(), ids stay valid in copies of the index
+          *        until it is compacted
+          */
+        void count_hit(uint32_t entry) const
+        {
+            if( entry < hits.size() )
+                ::count_hit(&hits[entry]);
+        }
+
+        /**
+          * @brief Call fn with the id and hit count of every entry
+          */
+        void for_each_hit(void (*fn)(uint32_t entry, uint32_t hits, void* ctx), void* ctx) const;
+
+        /**
+          * @brief Name and MATCH_* / ALLOW_* flags of entry
+          *
+          * @param name buffer of at least 256 bytes
+          *
+          * @return length of name
+          */
+        size_t entry_name(uint32_t entry, char* name, uint8_t* flags) const;
+
+        /**
+          * @brief Upper bound of entry ids, new entries get higher ids and ids aren't reused
+          */
+        uint32_t entry_ids() const { return nodes.size(); }
+
+        /**
+          * @brief Nodes left behind by erased entries, up to entry_ids()
+          */
+        size_t erased_nodes() const { return dead; }
+
+        /**
+          * @brief Free nodes and labels of erased entries
+          *
+          * Entries are renumbered in the order of their ids, their hits move with them
+          */
+        void compact();
+
+        /**
+          * @brief Call fn with the suffix hash of every entry
+          */
+        void for_each_hash(hash_callback fn, void* ctx) const;
+
+        size_t size() const { return count; }
+        size_t memory() const;
+        void clear();
+};
+
+#endif
@@ -0,0 +1,168 @@
+#!/usr/bin/env python
+"""
+Generates default_rules.h from defaultblacklist.txt at build time
+
+Domain rules go into a minimal perfect hash table keyed by the suffix hash of
+their name (domain_hash() in domain_index.cpp), built with hash and displace.
+Wildcard rules are split into their literal segments, so they are matched
+without compiling anything at runtime. Everything is constant and ends up in
+flash, see default_list.cpp for the lookup.
+
+Usage: gen_default_rules.py defaultblacklist.txt default_rules.h
+"""
+import sys
+
+MASK = 0xFFFFFFFF
+MATCH_EXACT = 0x01
+MATCH_SUBDOMAINS = 0x02
+MAX_DISPLACEMENT = 0xFFFF
+
+
+def label_hash(label):
+    # FNV-1a
+    h = 2166136261
+    for c in label.encode('ascii'):
+        h ^= c
+        h = (h * 16777619) & MASK
+    return h
+
+
+def suffix_hash(parent, label):
+    h = ((parent ^ label) * 0x9E3779B1) & MASK
+    return h ^ (h >> 15)
+
+
+def domain_hash(domain):
+    h = 0x811C9DC5
+    for label in reversed(domain.split('.')):
+        h = suffix_hash(h, label_hash(label))
+    return h
+
+
+def slot_hash(h, displacement):
+    # Same as slot_of() in default_list.cpp
+    h = (h ^ ((displacement * 0x9E3779B1) & MASK)) & MASK
+    h ^= h >> 16
+    h = (h * 0x85EBCA6B) & MASK
+    h ^= h >> 13
+    return h
+
+
+def read_rules(path):
+    """Rules as (name, flag) in file order, split like list_parser::emit()"""
+    rules = []
+    with open(path, 'rb') as f:
+        for raw in f.read().decode('ascii').splitlines():
+            line = raw.split('#', 1)[0].strip().lower().rstrip('.')
+            if not line or line.startswith('@@'):
+                continue
+            # "*.example.com" is example.com's subdomains, other wildcards stay patterns
+            flag = MATCH_EXACT
+            if line.startswith('*.') and '*' not in line[2:] and '?' not in line[2:]:
+                line = line[2:]
+                flag = MATCH_SUBDOMAINS
+            if (line, flag) not in rules:
+                rules.append((line, flag))
+    return rules
+
+
+def perfect_hash(names):
+    """Displacement per bucket so every name lands in its own slot"""
+    slots = len(names)
+    buckets = max(1, (slots + 1) // 2)
+    grouped = [[] for _ in range(buckets)]
+    for name in names:
+        grouped[domain_hash(name) % buckets].append(name)
+
+    table = [None] * slots
+    displacements = [0] * buckets
+    for b in sorted(range(buckets), key=lambda b: -len(grouped[b])):
+        if not grouped[b]:
+            continue
+        for d in range(MAX_DISPLACEMENT + 1):
+            taken = [slot_hash(domain_hash(n), d) % slots for n in grouped[b]]
+            if len(set(taken)) == len(taken) and all(table[s] is None for s in taken):
+                for n, s in zip(grouped[b], taken):
+                    table[s] = n
+                displacements[b] = d
+                break
+        else:
+            sys.exit('No perfect hash for bucket %d' % b)
+    return table, displacements
+
+
+def split_pattern(text):
+    segments = [s for s in text.split('*') if s]
+    return segments, not text.startswith('*'), not text.endswith('*')
+
+
+def c_string(s):
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    rules = read_rules(sys.argv[1])
+
+    domains = []
+    patterns = []
+    for index, (name, flag) in enumerate(rules):
+        if '*' in name or '?' in name:
+            patterns.append((name, index))
+        elif name not in domains:
+            domains.append(name)
+
+    table, displacements = perfect_hash(domains)
+    rule_of = dict(((name, flag), index) for index, (name, flag) in enumerate(rules))
+
+    out = []
+    out.append('// Generated by gen_default_rules.py from %s, do not edit' % sys.argv[1].replace('\\', '/').split('/')[-1])
+    out.append('#ifndef DEFAULT_RULES_H')
+    out.append('#define DEFAULT_RULES_H')
+    out.append('')
+    out.append('#define DEFAULT_RULES       %d' % len(rules))
+    out.append('#define DEFAULT_SLOTS       %d' % len(table))
+    out.append('#define DEFAULT_BUCKETS     %d' % len(displacements))
+    out.append('#define DEFAULT_PATTERNS    %d' % len(patterns))
+    out.append('')
+    out.append('static constexpr const char* default_rule_text[] = {')
+    for name, flag in rules:
+        out.append('    %s,' % c_string(('*.' if flag == MATCH_SUBDOMAINS else '') + name))
+    out.append('};')
+    out.append('')
+    out.append('static constexpr uint16_t default_displacements[] = {')
+    out.append('    ' + ', '.join(str(d) for d in displacements))
+    out.append('};')
+    out.append('')
+    out.append('static constexpr default_slot default_slots[] = {')
+    for name in table:
+        exact = rule_of.get((name, MATCH_EXACT), -1)
+        subdomains = rule_of.get((name, MATCH_SUBDOMAINS), -1)
+        out.append('    { 0x%08XUL, %s, %d, %d },' % (domain_hash(name), c_string(name), exact, subdomains))
+    if not table:
+        out.append('    { 0, "", -1, -1 },')
+    out.append('};')
+    out.append('')
+    for i, (text, index) in enumerate(patterns):
+        segments = split_pattern(text)[0]
+        out.append('static constexpr const char* default_segments_%d[] = { %s };' %
+                   (i, ', '.join(c_string(s) for s in segments) if segments else 'NULL'))
+    out.append('')
+    out.append('static constexpr default_pattern default_patterns[] = {')
+    for i, (text, index) in enumerate(patterns):
+        segments, start, end = split_pattern(text)
+        out.append('    { default_segments_%d, %d, %s, %s, %d },' %
+                   (i, len(segments), 'true' if start else 'false', 'true' if end else 'false', index))
+    if not patterns:
+        out.append('    { NULL, 0, false, false, -1 },')
+    out.append('};')
+    out.append('')
+    out.append('#endif')
+
+    with open(sys.argv[2], 'w') as f:
+        f.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,300 @@
+#include "lists.h"
+#include "list_image.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#else
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef CONFIG_LOCAL_LOG_LEVEL
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#include "esp_log.h"
+static const char *TAG = "IMAGE";
+
+#define IMAGE_PARTITION_LABEL   "blocklist"
+#define IMAGE_PARTITION_SUBTYPE ((esp_partition_subtype_t)0x40)
+#define SECTOR_SIZE             4096
+#ifndef IMAGE_FILE_PATH
+#define IMAGE_FILE_PATH         "blacklist.img"     // Used instead of partition on linux builds
+#endif
+
+static SemaphoreHandle_t image_mutex;
+static image_reader image;
+static size_t update_offset;                        // Bytes written by current update
+static size_t update_size;
+
+#ifdef ESP_PLATFORM
+static const esp_partition_t* partition;
+static spi_flash_mmap_handle_t map_handle;
+static bool mapped;
+
+static esp_err_t map_image()
+{
+    const void* data;
+    image_header header;
+    esp_err_t err = esp_partition_read(partition, 0, &header, sizeof(header));
+    if( err != ESP_OK )
+        return err;
+
+    // Map only the image, the rest of the partition doesn't use MMU pages
+    size_t size = (header.magic == IMAGE_MAGIC && header.size <= partition->size) ? header.size : SECTOR_SIZE;
+    err = esp_partition_mmap(partition, 0, size, SPI_FLASH_MMAP_DATA, &data, &map_handle);
+    if( err != ESP_OK )
+        return err;
+    mapped = true;
+
+    if( !image.assign((const uint8_t*)data, size) )
+        return ESP_ERR_NOT_FOUND;
+    return ESP_OK;
+}
+
+static void unmap_image()
+{
+    image.clear();
+    if( mapped )
+        spi_flash_munmap(map_handle);
+    mapped = false;
+}
+
+static esp_err_t open_image()
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, IMAGE_PARTITION_SUBTYPE, IMAGE_PARTITION_LABEL);
+    return (partition != NULL) ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+static size_t image_capacity()
+{
+    return partition->size;
+}
+
+static esp_err_t write_image(size_t offset, const void* data, size_t len)
+{
+    // Erase sectors as the write reaches them
+    size_t erased = (offset + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    if( offset + len > erased )
+    {
+        size_t end = (offset + len + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        esp_err_t err = esp_partition_erase_range(partition, erased, end - erased);
+        if( err != ESP_OK )
+            return err;
+    }
+    return esp_partition_write(partition, offset, data, len);
+}
+#else
+static int fd = -1;
+static const void* map_data;
+static size_t map_size;
+
+static esp_err_t map_image()
+{
+    fd = open(IMAGE_FILE_PATH, O_RDONLY);
+    if( fd < 0 )
+        return ESP_ERR_NOT_FOUND;
+
+    struct stat s;
+    if( fstat(fd, &s) != 0 || s.st_size == 0 )
+        return ESP_ERR_NOT_FOUND;
+
+    map_data = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if( map_data == MAP_FAILED )
+    {
+        map_data = NULL;
+        return ESP_FAIL;
+    }
+    map_size = s.st_size;
+
+    if( !image.assign((const uint8_t*)map_data, map_size) )
+        return ESP_ERR_NOT_FOUND;
+    return ESP_OK;
+}
+
+static void unmap_image()
+{
+    image.clear();
+    if( map_data != NULL )
+        munmap((void*)map_data, map_size);
+    if( fd >= 0 )
+        close(fd);
+    map_data = NULL;
+    fd = -1;
+}
+
+static esp_err_t open_image()
+{
+    return ESP_OK;
+}
+
+static size_t image_capacity()
+{
+    return SIZE_MAX;
+}
+
+static esp_err_t write_image(size_t offset, const void* data, size_t len)
+{
+    FILE* f = fopen(IMAGE_FILE_PATH, offset == 0 ? "wb" : "r+b");
+    if( f == NULL )
+        return ESP_FAIL;
+
+    bool ok = fseek(f, offset, SEEK_SET) == 0 && fwrite(data, 1, len, f) == len;
+    fclose(f);
+    return ok ? ESP_OK : ESP_FAIL;
+}
+#endif
+
+// Map image, the block index of a valid image may not fit in memory. image_mutex must be held
+static esp_err_t map_image_safe()
+{
+    try{
+        return map_image();
+    }catch(const std::bad_alloc& e){
+        ESP_LOGE(TAG, "Not enough memory for blocklist image index");
+        return ESP_ERR_NO_MEM;
+    }
+}
+
+esp_err_t initialize_list_image()
+{
+    if( image_mutex == NULL )
+    {
+        image_mutex = xSemaphoreCreateMutex();
+        if( image_mutex == NULL )
+            return ESP_ERR_NO_MEM;
+    }
+
+    if( open_image() != ESP_OK )
+    {
+        ESP_LOGW(TAG, "No blocklist partition");
+        return ESP_OK;
+    }
+
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    unmap_image();
+    esp_err_t err = map_image_safe();
+    if( err != ESP_OK )
+        unmap_image();
+    xSemaphoreGive(image_mutex);
+    invalidate_verdicts();
+
+    if( err == ESP_OK )
+        ESP_LOGI(TAG, "Mapped blocklist image, %d entries (%d bytes RAM)", image.size_entries(), image.memory());
+    else if( err != ESP_ERR_NO_MEM )
+        ESP_LOGI(TAG, "No blocklist image");
+    return err == ESP_ERR_NO_MEM ? err : ESP_OK;
+}
+
+IRAM_ATTR bool in_list_image(const domain_key& key)
+{
+    if( image_mutex == NULL )
+        return false;
+
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    bool found = image.match(key);
+    xSemaphoreGive(image_mutex);
+    return found;
+}
+
+// Set checksum of image being read on the first call, false if image changed since.
+// image_mutex must be held
+static bool same_image(uint32_t* checksum)
+{
+    if( *checksum == 0 )
+        *checksum = image.checksum();
+    return *checksum == image.checksum();
+}
+
+int read_list_image_block(size_t block, void (*fn)(const char* name, size_t len, uint8_t flags, void* ctx), 
+                          void* ctx, uint32_t* checksum)
+{
+    if( image_mutex == NULL )
+        return 0;
+
+    // Lookups only wait for one block to be decoded
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    int read = -1;
+    if( same_image(checksum) )
+        read = image.for_each_entry(block, fn, ctx) ? 1 : 0;
+    xSemaphoreGive(image_mutex);
+    return read;
+}
+
+int read_list_image(size_t offset, void* buffer, size_t size, uint32_t* checksum)
+{
+    if( image_mutex == NULL )
+        return 0;
+
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    int read = -1;
+    if( same_image(checksum) )
+    {
+        size_t available = offset < image.size_bytes() ? image.size_bytes() - offset : 0;
+        read = std::min(size, available);
+        if( read > 0 )
+            memcpy(buffer, image.bytes() + offset, read);
+    }
+    xSemaphoreGive(image_mutex);
+    return read;
+}
+
+esp_err_t begin_list_image_update(size_t size)
+{
+    if( image_mutex == NULL || open_image() != ESP_OK )
+        return ESP_ERR_NOT_FOUND;
+    if( size < sizeof(image_header) || size > image_capacity() )
+        return ESP_ERR_INVALID_SIZE;
+
+    // Image is unavailable until the update ends
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    unmap_image();
+    xSemaphoreGive(image_mutex);
+    invalidate_verdicts();
+
+    update_offset = 0;
+    update_size = size;
+    return ESP_OK;
+}
+
+esp_err_t write_list_image(const void* data, size_t len)
+{
+    if( update_offset + len > update_size )
+        return ESP_ERR_INVALID_SIZE;
+
+    esp_err_t err = write_image(update_offset, data, len);
+    if( err == ESP_OK )
+        update_offset += len;
+    return err;
+}
+
+esp_err_t end_list_image_update()
+{
+    if( update_offset != update_size )
+        ESP_LOGE(TAG, "Image incomplete, %d of %d bytes", update_offset, update_size);
+
+    xSemaphoreTake(image_mutex, portMAX_DELAY);
+    esp_err_t err = map_image_safe();
+    if( err != ESP_OK )
+        unmap_image();
+    xSemaphoreGive(image_mutex);
+    invalidate_verdicts();
+
+    if( err == ESP_ERR_NO_MEM )
+        return err;
+    if( err != ESP_OK )
+    {
+        ESP_LOGE(TAG, "Invalid blocklist image");
+        return ESP_ERR_INVALID_ARG;
+    }
+    ESP_LOGI(TAG, "Updated blocklist image, %d entries", image.size_entries());
+    return ESP_OK;
+}
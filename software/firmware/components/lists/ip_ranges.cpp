@@ -0,0 +1,334 @@
+#include "lists.h"
+#include "prefix_tree.h"
+#include "error.h"
+#include "filesystem.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "lwip/inet.h"
+#include <string.h>
+#include <ctype.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#ifdef CONFIG_LOCAL_LOG_LEVEL
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#include "esp_log.h"
+static const char *TAG = "IPLIST";
+
+static SemaphoreHandle_t ranges_mutex;
+static prefix_tree<uint32_t>* ip4_ranges;   // Blocked IPv4 ranges
+static prefix_tree<ip6_key>* ip6_ranges;    // Blocked IPv6 ranges
+
+// Policy groups, client ranges map to an index into group_lists
+struct policy_groups {
+    prefix_tree<uint32_t> ip4;
+    prefix_tree<ip6_key> ip6;
+    std::vector<uint16_t> group_lists;
+};
+static SemaphoreHandle_t groups_mutex;
+static policy_groups* groups;
+
+#define MAX_GROUPS 64
+
+
+static uint64_t load_be64(const uint8_t* bytes)
+{
+    uint64_t value = 0;
+    for( int i = 0; i < 8; i++ )
+    {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+// Parse "a.b.c.d/len", "x:y::z/len" or a bare address into tree
+static bool add_range(char* range, prefix_tree<uint32_t>* ip4, prefix_tree<ip6_key>* ip6, uint16_t value = 0)
+{
+    int len = -1;
+    char* slash = strchr(range, '/');
+    if( slash != NULL )
+    {
+        *slash = '\0';
+        char* end;
+        len = strtol(slash+1, &end, 10);
+        if( end == slash+1 || *end != '\0' || len < 0 )
+            return false;
+    }
+
+    struct in_addr addr4;
+    struct in6_addr addr6;
+    if( inet_pton(AF_INET, range, &addr4) == 1 )
+    {
+        if( len > 32 )
+            return false;
+        ip4->insert(ntohl(addr4.s_addr), len < 0 ? 32 : len, value);
+    }
+    else if( inet_pton(AF_INET6, range, &addr6) == 1 )
+    {
+        if( len > 128 )
+            return false;
+        ip6_key key = { load_be64(addr6.s6_addr), load_be64(addr6.s6_addr + 8) };
+        ip6->insert(key, len < 0 ? 128 : len, value);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Strip comments & whitespace, returns empty string for blank lines
+static char* trim_line(char* line)
+{
+    line[strcspn(line, "#\r\n")] = '\0';
+    while( isspace((unsigned char)*line) )
+        line++;
+
+    size_t len = strlen(line);
+    while( len > 0 && isspace((unsigned char)line[len-1]) )
+        line[--len] = '\0';
+
+    return line;
+}
+
+static void swap_ranges(prefix_tree<uint32_t>* ip4, prefix_tree<ip6_key>* ip6)
+{
+    xSemaphoreTake(ranges_mutex, portMAX_DELAY);
+    std::swap(ip4, ip4_ranges);
+    std::swap(ip6, ip6_ranges);
+    xSemaphoreGive(ranges_mutex);
+
+    delete ip4;
+    delete ip6;
+}
+
+esp_err_t initialize_ip_blacklist()
+{
+    if( ranges_mutex == NULL )
+    {
+        ranges_mutex = xSemaphoreCreateMutex();
+        if( ranges_mutex == NULL )
+            return ESP_ERR_NO_MEM;
+    }
+
+    prefix_tree<uint32_t>* ip4 = new prefix_tree<uint32_t>();
+    prefix_tree<ip6_key>* ip6 = new prefix_tree<ip6_key>();
+    try{
+        using namespace fs;
+        if( exists("/ipblacklist.txt") )
+        {
+            file list = open("/ipblacklist.txt", "r");
+
+            char entry[64];
+            while( fgets(entry, sizeof(entry), list.handle) != NULL )
+            {
+                char* range = trim_line(entry);
+                if( range[0] != '\0' && !add_range(range, ip4, ip6) )
+                {
+                    ESP_LOGW(TAG, "Skipping invalid range %s", range);
+                }
+            }
+        }
+    }catch(const Err& e){
+        delete ip4;
+        delete ip6;
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Loaded IP blacklist (%d IPv4 nodes, %d IPv6 nodes)", ip4->size(), ip6->size());
+    swap_ranges(ip4, ip6);
+    return ESP_OK;
+}
+
+esp_err_t save_ip_blacklist(const char* ranges)
+{
+    // Validate every line before touching the saved list
+    std::string list(ranges);
+    prefix_tree<uint32_t> ip4;
+    prefix_tree<ip6_key> ip6;
+    char* save;
+    for( char* line = strtok_r(&list[0], "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save) )
+    {
+        char* range = trim_line(line);
+        if( range[0] != '\0' && !add_range(range, &ip4, &ip6) )
+        {
+            return URL_ERR_INVALID_URL;
+        }
+    }
+
+    try{
+        fs::file f = fs::open("/ipblacklist.txt", "w");
+        f.write(ranges, 1, strlen(ranges));
+    }catch(const Err& e){
+        return ESP_FAIL;
+    }
+
+    return initialize_ip_blacklist();
+}
+
+IRAM_ATTR bool ip_in_blacklist(const uint8_t* addr, size_t len)
+{
+    if( ranges_mutex == NULL )
+        return false;
+
+    bool blocked = false;
+    uint16_t value;
+    xSemaphoreTake(ranges_mutex, portMAX_DELAY);
+    if( len == 4 && ip4_ranges != NULL )
+    {
+        uint32_t key = ((uint32_t)addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3];
+        blocked = ip4_ranges->lookup(key, &value);
+    }
+    else if( len == 16 && ip6_ranges != NULL )
+    {
+        ip6_key key = { load_be64(addr), load_be64(addr + 8) };
+        blocked = ip6_ranges->lookup(key, &value);
+    }
+    xSemaphoreGive(ranges_mutex);
+
+    return blocked;
+}
+
+// Parse comma separated list names into list bits
+static bool parse_lists(char* names, uint16_t* lists)
+{
+    *lists = 0;
+    char* save;
+    for( char* name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save) )
+    {
+        char* end;
+        if( strcmp(name, "all") == 0 )
+            *lists |= ALL_LISTS;
+        else if( strcmp(name, "none") == 0 )
+            continue;
+        else if( strcmp(name, "user") == 0 )
+            *lists |= USER_LIST;
+        else if( strcmp(name, "image") == 0 )
+            *lists |= IMAGE_LIST;
+        else if( strncmp(name, "sub", 3) == 0 && isdigit((unsigned char)name[3]) )
+        {
+            long i = strtol(name+3, &end, 10);
+            if( *end != '\0' || i < 1 || i > MAX_SUBSCRIPTION_LISTS )
+                return false;
+            *lists |= SUBSCRIPTION_LIST(i-1);
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+// Parse "name lists clients..." into groups
+static bool add_group(char* line, policy_groups* parsed)
+{
+    char* save;
+    char* name = strtok_r(line, " \t", &save);
+    char* names = strtok_r(NULL, " \t", &save);
+    uint16_t lists;
+    if( name == NULL || names == NULL || !parse_lists(names, &lists) || parsed->group_lists.size() >= MAX_GROUPS )
+        return false;
+
+    uint16_t group = parsed->group_lists.size();
+    parsed->group_lists.push_back(lists);
+    for( char* range = strtok_r(NULL, " \t", &save); range != NULL; range = strtok_r(NULL, " \t", &save) )
+    {
+        if( !add_range(range, &parsed->ip4, &parsed->ip6, group) )
+            return false;
+    }
+    return true;
+}
+
+esp_err_t initialize_policy_groups()
+{
+    if( groups_mutex == NULL )
+    {
+        groups_mutex = xSemaphoreCreateMutex();
+        if( groups_mutex == NULL )
+            return ESP_ERR_NO_MEM;
+    }
+
+    policy_groups* parsed = new policy_groups();
+    try{
+        using namespace fs;
+        if( exists("/groups.txt") )
+        {
+            file list = open("/groups.txt", "r");
+
+            char line[512];
+            while( fgets(line, sizeof(line), list.handle) != NULL )
+            {
+                char* group = trim_line(line);
+                if( group[0] != '\0' && !add_group(group, parsed) )
+                {
+                    ESP_LOGW(TAG, "Skipping invalid group %s", group);
+                }
+            }
+        }
+    }catch(const Err& e){
+        delete parsed;
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Loaded %d policy groups", parsed->group_lists.size());
+    xSemaphoreTake(groups_mutex, portMAX_DELAY);
+    std::swap(parsed, groups);
+    xSemaphoreGive(groups_mutex);
+
+    delete parsed;
+    return ESP_OK;
+}
+
+esp_err_t save_policy_groups(const char* text)
+{
+    // Validate every line before touching the saved groups
+    std::string list(text);
+    policy_groups parsed;
+    char* save;
+    for( char* line = strtok_r(&list[0], "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save) )
+    {
+        char* group = trim_line(line);
+        if( group[0] != '\0' && !add_group(group, &parsed) )
+        {
+            return URL_ERR_INVALID_URL;
+        }
+    }
+
+    try{
+        fs::file f = fs::open("/groups.txt", "w");
+        f.write(text, 1, strlen(text));
+    }catch(const Err& e){
+        return ESP_FAIL;
+    }
+
+    return initialize_policy_groups();
+}
+
+IRAM_ATTR uint16_t client_lists(const uint8_t* addr, size_t len)
+{
+    if( groups_mutex == NULL )
+        return ALL_LISTS;
+
+    // One longest prefix match, regardless of the number of groups
+    uint16_t lists = ALL_LISTS;
+    uint16_t group;
+    bool found = false;
+    xSemaphoreTake(groups_mutex, portMAX_DELAY);
+    if( groups != NULL && len == 4 )
+    {
+        uint32_t key = ((uint32_t)addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3];
+        found = groups->ip4.lookup(key, &group);
+    }
+    else if( groups != NULL && len == 16 )
+    {
+        ip6_key key = { load_be64(addr), load_be64(addr + 8) };
+        found = groups->ip6.lookup(key, &group);
+    }
+    if( found )
+        lists = groups->group_lists[group];
+    xSemaphoreGive(groups_mutex);
+
+    return lists;
+}
@@ -0,0 +1,340 @@
+#include "list_image.h"
+#include "domain_index.h"
+#include <string.h>
+
+#include <algorithm>
+
+static inline uint32_t key_prefix(const uint8_t* key, size_t len)
+{
+    uint32_t prefix = 0;
+    for( size_t i = 0; i < 4; i++ )
+        prefix = (prefix << 8) | (i < len ? key[i] : 0);
+    return prefix;
+}
+
+uint32_t image_checksum(const uint8_t* data, size_t len, uint32_t crc)
+{
+    // Nibble table keeps this small enough for flash and fast enough to check a whole partition at boot
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+
+    crc = ~crc;
+    for( size_t i = 0; i < len; i++ )
+    {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+// Decode the front coded entry at b into key, which holds the previous key.
+// Returns the next entry, NULL at the end of the block or if the entry is invalid
+static const uint8_t* next_entry(const uint8_t* b, const uint8_t* end, uint8_t* key, size_t* key_len)
+{
+    if( b + 2 > end )
+        return NULL;
+    size_t shared = b[0];
+    size_t suffix = b[1];
+    if( suffix == 0 || shared > *key_len || shared + suffix > IMAGE_MAX_KEY || suffix > (size_t)(end - b - 2) )
+        return NULL;
+
+    memcpy(key + shared, b + 2, suffix);
+    *key_len = shared + suffix;
+    return b + 2 + suffix;
+}
+
+static int compare(const uint8_t* a, size_t a_len, const uint8_t* b, size_t b_len)
+{
+    int cmp = memcmp(a, b, std::min(a_len, b_len));
+    if( cmp != 0 )
+        return cmp;
+    return (a_len < b_len) ? -1 : (a_len > b_len);
+}
+
+
+bool image_reader::assign(const uint8_t* data_, size_t size_)
+{
+    clear();
+
+    image_header header;
+    if( data_ == NULL || size_ < sizeof(header) )
+        return false;
+    memcpy(&header, data_, sizeof(header));
+
+    // Counts are bounded by the data before anything is sized by them, in 64 bits so
+    // a crafted header can't wrap the size check
+    if( header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION ||
+        header.block_size < sizeof(header) || header.block_size % 8 != 0 || header.size > size_ ||
+        header.blocks >= size_/header.block_size || header.filter_blocks > size_/IMAGE_FILTER_BLOCK ||
+        header.size != ((uint64_t)header.blocks + 1)*header.block_size + (uint64_t)header.filter_blocks*IMAGE_FILTER_BLOCK )
+    {
+        return false;
+    }
+
+    if( image_checksum(data_ + header.block_size, header.size - header.block_size) != header.checksum )
+        return false;
+
+    data = data_;
+    size = header.size;
+    block_size = header.block_size;
+    // First entry of each block is read in place by the binary search
+    index.resize(header.blocks);
+    for( size_t n = 0; n < header.blocks; n++ )
+    {
+        const uint8_t* b = block(n);
+        if( b[0] != 0 || b[1] == 0 || 2 + (size_t)b[1] > block_size )
+        {
+            clear();
+            return false;
+        }
+        index[n] = key_prefix(b + 2, b[1]);
+    }
+    filter.assign(block(header.blocks), header.filter_blocks);
+    entries = header.entries;
+    return true;
+}
+
+void image_reader::clear()
+{
+    data = NULL;
+    size = 0;
+    block_size = 0;
+    entries = 0;
+    std::vector<uint32_t>().swap(index);
+    filter = bloom_view();
+}
+
+bool image_reader::contains(const uint8_t* key, size_t len) const
+{
+    // Last block whose first key is <= key
+    uint32_t prefix = key_prefix(key, len);
+    size_t lo = std::lower_bound(index.begin(), index.end(), prefix) - index.begin();
+    size_t hi = std::upper_bound(index.begin() + lo, index.end(), prefix) - index.begin();
+    while( lo < hi )
+    {
+        size_t mid = lo + (hi - lo)/2;
+        const uint8_t* b = block(mid);
+        if( compare(b + 2, b[1], key, len) <= 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if( lo == 0 )
+        return false;
+
+    const uint8_t* b = block(lo - 1);
+    const uint8_t* end = b + block_size;
+    uint8_t current[IMAGE_MAX_KEY];
+    size_t current_len = 0;
+    while( (b = next_entry(b, end, current, &current_len)) != NULL )
+    {
+        int cmp = compare(current, current_len, key, len);
+        if( cmp == 0 )
+            return true;
+        if( cmp > 0 )
+            break;
+    }
+    return false;
+}
+
+bool image_reader::match(const char* domain, size_t len) const
+{
+    if( entries == 0 || len == 0 || len + 1 > IMAGE_MAX_KEY )
+        return false;
+
+    // Check prefilter for the name and each of its parents first
+    uint32_t hash = ROOT_HASH;
+    size_t end = len;
+    bool maybe = false;
+    while( !maybe )
+    {
+        size_t start = end;
+        while( start > 0 && domain[start-1] != '.' )
+            start--;
+
+        hash = suffix_hash(hash, label_hash(domain + start, end - start));
+        maybe = filter.possibly_contains(hash);
+        if( start == 0 )
+            break;
+        end = start - 1;
+    }
+    return maybe && find(domain, len);
+}
+
+bool image_reader::match(const domain_key& key) const
+{
+    if( entries == 0 || key.len == 0 || key.len + 1 > IMAGE_MAX_KEY )
+        return false;
+
+    bool maybe = false;
+    for( size_t i = key.labels; i-- > 0 && !maybe; )
+        maybe = filter.possibly_contains(key.hashes[i]);
+    return maybe && find(key.name, key.len);
+}
+
+// Look up domain and its ancestors in the blocks, after the prefilter
+bool image_reader::find(const char* domain, size_t len) const
+{
+    uint8_t key[IMAGE_MAX_KEY];
+    size_t key_len = reverse_labels(domain, len, (char*)key);
+
+    key[key_len] = MATCH_EXACT;
+    if( contains(key, key_len + 1) )
+        return true;
+
+    // Ancestors are prefixes of the key ending before a '.'
+    for( size_t i = 0; i < key_len; i++ )
+    {
+        if( key[i] != '.' )
+            continue;
+
+        uint8_t saved = key[i];
+        key[i] = MATCH_SUBDOMAINS;
+        bool found = contains(key, i + 1);
+        key[i] = saved;
+        if( found )
+            return true;
+    }
+    return false;
+}
+
+void image_reader::for_each_hash(void (*fn)(uint32_t hash, void* ctx), void* ctx) const
+{
+    uint8_t key[IMAGE_MAX_KEY];
+    for( size_t n = 0; n < index.size(); n++ )
+    {
+        const uint8_t* b = block(n);
+        const uint8_t* end = b + block_size;
+        size_t key_len = 0;
+        while( (b = next_entry(b, end, key, &key_len)) != NULL )
+        {
+            // Labels are already ordered from the TLD down, last byte is the match flag
+            uint32_t hash = ROOT_HASH;
+            size_t start = 0;
+            for( size_t i = 0; i < key_len; i++ )
+            {
+                if( key[i] == '.' || i == key_len - 1 )
+                {
+                    hash = suffix_hash(hash, label_hash((const char*)key + start, i - start));
+                    start = i + 1;
+                }
+            }
+            fn(hash, ctx);
+        }
+    }
+}
+
+uint32_t image_reader::checksum() const
+{
+    if( entries == 0 )
+        return 0;
+    image_header header;
+    memcpy(&header, data, sizeof(header));
+    return header.checksum;
+}
+
+bool image_reader::for_each_entry(size_t n, name_callback fn, void* ctx) const
+{
+    if( n >= index.size() )
+        return false;
+
+    uint8_t key[IMAGE_MAX_KEY];
+    char name[IMAGE_MAX_KEY];
+    const uint8_t* b = block(n);
+    const uint8_t* end = b + block_size;
+    size_t key_len = 0;
+    while( (b = next_entry(b, end, key, &key_len)) != NULL )
+    {
+        // Last byte of the key is the match flag
+        size_t len = reverse_labels((const char*)key, key_len - 1, name);
+        fn(name, len, key[key_len - 1], ctx);
+    }
+    return true;
+}
+
+bool image_builder::add(const char* domain, size_t len, uint8_t flags)
+{
+    if( len == 0 || len + 1 > IMAGE_MAX_KEY - 1 )
+        return false;
+
+    uint8_t key[IMAGE_MAX_KEY];
+    size_t key_len = reverse_labels(domain, len, (char*)key);
+    if( flags & MATCH_EXACT )
+    {
+        key[key_len] = MATCH_EXACT;
+        keys.push_back(std::string((const char*)key, key_len + 1));
+    }
+    if( flags & MATCH_SUBDOMAINS )
+    {
+        key[key_len] = MATCH_SUBDOMAINS;
+        keys.push_back(std::string((const char*)key, key_len + 1));
+    }
+    if( flags & (MATCH_EXACT | MATCH_SUBDOMAINS) )
+        hashes.push_back(domain_hash(domain, len));
+    return true;
+}
+
+void image_builder::build(std::vector<uint8_t>& image, uint32_t created)
+{
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    image.assign(IMAGE_BLOCK_SIZE, 0);
+    uint32_t blocks = 0;
+    size_t used = IMAGE_BLOCK_SIZE;         // Space used in current block, full to start a new one
+    const std::string* previous = NULL;
+    for( size_t i = 0; i < keys.size(); i++ )
+    {
+        const std::string& key = keys[i];
+        size_t shared = 0;
+        if( previous != NULL )
+        {
+            while( shared < key.size() && shared < previous->size() && shared < 0xFF && key[shared] == (*previous)[shared] )
+                shared++;
+        }
+
+        // Keep room for the [0][0] terminator
+        if( used + 2 + (key.size() - shared) + 2 > IMAGE_BLOCK_SIZE )
+        {
+            image.resize(image.size() + IMAGE_BLOCK_SIZE, 0);
+            blocks++;
+            used = 0;
+            shared = 0;
+        }
+
+        uint8_t* b = &image[image.size() - IMAGE_BLOCK_SIZE + used];
+        b[0] = shared;
+        b[1] = key.size() - shared;
+        memcpy(b + 2, key.data() + shared, key.size() - shared);
+        used += 2 + key.size() - shared;
+        previous = &key;
+    }
+
+    // Prefilter isn't bounded like the one in RAM, it is read in place
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+    bloom_filter prefilter;
+    prefilter.reset(hashes.size(), SIZE_MAX);
+    for( size_t i = 0; i < hashes.size(); i++ )
+        prefilter.add(hashes[i]);
+    const uint8_t* filter = (const uint8_t*)prefilter.data();
+    image.insert(image.end(), filter, filter + prefilter.block_count()*IMAGE_FILTER_BLOCK);
+
+    image_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.block_size = IMAGE_BLOCK_SIZE;
+    header.entries = keys.size();
+    header.blocks = blocks;
+    header.size = image.size();
+    header.filter_blocks = prefilter.block_count();
+    header.created = created;
+    header.checksum = image_checksum(&image[IMAGE_BLOCK_SIZE], image.size() - IMAGE_BLOCK_SIZE);
+    memcpy(&image[0], &header, sizeof(header));
+    std::vector<std::string>().swap(keys);
+    std::vector<uint32_t>().swap(hashes);
+}
@@ -0,0 +1,131 @@
+#ifndef LIST_IMAGE_H
+#define LIST_IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "bloom.h"
+#include "domain_index.h"
+#include <string>
+#include <vector>
+
+#define IMAGE_MAGIC         0x494C4B42      // "BKLI"
+#define IMAGE_VERSION       2
+#define IMAGE_BLOCK_SIZE    1024
+#define IMAGE_MAX_KEY       256
+#define IMAGE_FILTER_BLOCK  64              // Bytes per prefilter block
+
+/**
+  * Binary blocklist image
+  * 
+  * Keys are domains with their labels reversed followed by a MATCH_* byte,
+  * "ads.example.com" listed exactly is "com.example.ads\x01". Keys are sorted 
+  * and front coded into fixed size blocks:
+  *     header block: image_header
+  *     data blocks:  [shared prefix length][suffix length][suffix]... [0][0]
+  *     prefilter:    bloom_filter blocks over the suffix hash of every name
+  * Each block starts with a full key, so blocks are decoded independently.
+  */
+struct image_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_size;
+    uint32_t entries;
+    uint32_t blocks;
+    uint32_t size;                  // Size of whole image, including header block
+    uint32_t filter_blocks;         // Prefilter blocks following the data blocks
+    uint32_t created;               // Build time, seconds since epoch
+    uint32_t checksum;              // CRC-32 of everything following the header block
+};
+
+/**
+  * @brief CRC-32 (IEEE 802.3), continued from crc
+  */
+uint32_t image_checksum(const uint8_t* data, size_t len, uint32_t crc = 0);
+
+/**
+  * @brief Reads an image in place, from a memory mapped partition or file
+  * 
+  * Only the first 4 bytes of the first key of each block are kept in RAM,
+  * a lookup is a binary search over those, and the full first keys of 
+  * blocks with the same prefix, followed by a single block decode. 
+  * Names the prefilter rules out are answered without touching the blocks.
+  */
+class image_reader {
+        const uint8_t* data;
+        size_t size;
+        uint16_t block_size;
+        uint32_t entries;
+        std::vector<uint32_t> index;   // First 4 bytes of each block, big endian
+        bloom_view filter;
+
+        const uint8_t* block(size_t n) const { return data + (n + 1)*block_size; }
+        bool contains(const uint8_t* key, size_t len) const;
+        bool find(const char* domain, size_t len) const;
+    public:
+        image_reader() : data(NULL), size(0), block_size(0), entries(0) {}
+
+        /**
+          * @brief Validate image and its checksum, and build block index
+          *
+          * @return false if image is invalid, the reader is left empty
+          */
+        bool assign(const uint8_t* data, size_t size);
+        void clear();
+
+        bool empty() const { return entries == 0; }
+        size_t size_entries() const { return entries; }
+        size_t memory() const { return index.capacity()*sizeof(uint32_t); }
+        const uint8_t* bytes() const { return data; }
+        size_t size_bytes() const { return size; }
+        uint32_t checksum() const;
+
+        /**
+          * @brief Check if normalized domain, or an ancestor listed with MATCH_SUBDOMAINS, is in image
+          */
+        bool match(const char* domain, size_t len) const;
+
+        /**
+          * @brief Same as match(), with the hashes of key for the prefilter
+          */
+        bool match(const domain_key& key) const;
+
+        /**
+          * @brief Call fn with the suffix hash of every entry
+          */
+        void for_each_hash(void (*fn)(uint32_t hash, void* ctx), void* ctx) const;
+
+        /**
+          * @brief Call fn with the name and MATCH_* flag of every entry in block n
+          *
+          * Blocks decode independently, so a caller can walk the image in steps
+          *
+          * @return false if there is no block n
+          */
+        bool for_each_entry(size_t n, void (*fn)(const char* name, size_t len, uint8_t flags, void* ctx), void* ctx) const;
+        size_t block_count() const { return index.size(); }
+};
+
+/**
+  * @brief Builds an image from domains added in any order
+  */
+class image_builder {
+        std::vector<std::string> keys;
+        std::vector<uint32_t> hashes;   // Suffix hash of every name, for the prefilter
+    public:
+        /**
+          * @brief Add normalized domain with MATCH_* flags
+          *
+          * @return false if domain is too long
+          */
+        bool add(const char* domain, size_t len, uint8_t flags);
+        size_t size() const { return keys.size(); }
+
+        /**
+          * @brief Build image with its prefilter and checksum, entries are cleared afterwards
+          *
+          * @param created build time stored in the header
+          */
+        void build(std::vector<uint8_t>& image, uint32_t created = 0);
+};
+
+#endif
@@ -2,18 +2,87 @@
 #include "error.h"
 #include "events.h"
 #include "filesystem.h"
+#include "domain_index.h"
+#include "bloom.h"
+#include "pattern.h"
+#include "subscriptions.h"
+#include "parser.h"
+#include "default_list.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include <esp_system.h>
 #include <string.h>
 
+#include <string>
+#include <vector>
+#include <map>
+#include <new>
+#include <algorithm>
+
 #ifdef CONFIG_LOCAL_LOG_LEVEL
 #define LOG_LOCAL_LEVEL ESP_LOG_INFO
 #endif
 #include "esp_log.h"
 static const char *TAG = "LIST";
 
+#define JOURNAL_PATH        "/blacklist.journal"
+#define IMPORT_PATH         "/importlist"
+#define MAX_JOURNAL_RECORDS 64              // Records before journal is compacted right away
+#define COMPACT_DELAY_MS    60000           // Time without edits before journal is compacted
+#define VERDICT_CACHE_SIZE  256             // Cached lookups, power of 2
+#define PATTERN_RULE        0x80000000      // Rule ids of patterns, others are index entries
+#define MAX_TOP_RULES       1000
+
+// Everything in_blacklist() queries, only hit counts and the pattern DFA change once
+// published. Writers publish a modified copy, readers keep the one they started with
+struct list_snapshot {
+    domain_index blacklist;                     // Domains and "*.domain" entries of all lists
+    pattern_set patterns;                       // Other entries containing '*' or '?'
+    std::vector<bool> defaults;                 // Default rules in blacklist.txt, matched from flash
+    bloom_filter prefilter;                     // Suffix hashes of all domain and allow entries
+    uint8_t categories[16];                     // CATEGORY_* flags of each list bit, 0 if untagged
+    uint32_t references;                        // Readers, plus one while published
+    uint32_t version;                           // Set when published, starting at 1
+};
+
+static SemaphoreHandle_t list_mutex;            // Taken by writers only, queries never wait for it
+static SemaphoreHandle_t file_mutex;            // blacklist.txt & journal, taken before list_mutex
+static SemaphoreHandle_t pattern_mutex;         // Pattern DFA is built while matching, copies don't read it
+static SemaphoreHandle_t import_mutex;          // One upload saved to IMPORT_PATH at a time
+static portMUX_TYPE snapshot_mux = portMUX_INITIALIZER_UNLOCKED;
+static list_snapshot* current;
+static uint32_t published;                      // Versions of published snapshots, changed under list_mutex
+static uint8_t categories = ALL_CATEGORIES;     // Enabled categories, changed under list_mutex
+static volatile uint16_t enabled_lists = ALL_LISTS; // Lists of the current snapshot that block with them
+static TaskHandle_t compact_task_handle = NULL;
+static size_t journal_records;
+
+// Recent lookups, direct mapped by the suffix hash of the normalized name. Entries
+// are only valid for the generation of the lists they were looked up in
+struct verdict {
+    uint32_t hash;
+    uint32_t check;                             // Second hash of the name, see name_check()
+    uint32_t generation;
+    uint32_t rule;                              // Rule deciding the verdict, see match_lists()
+    uint32_t version;                           // Snapshot rule is an id in
+    uint16_t lists;                             // Every list blocking the name
+    uint8_t len;
+};
+static verdict verdicts[VERDICT_CACHE_SIZE];
+static portMUX_TYPE verdict_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t verdict_generation = 1;        // Zeroed entries are never valid
+
+#define MAX_PREFILTER_SIZE (64*1024)
+#define EXPORT_CHUNK_SIZE  1024
+
 
 bool valid_url(const char* url)
 {
+    // Allowlist entries start with "@@"
+    if( strncmp(url, "@@", 2) == 0 )
+        url += 2;
+
     for(int i = 0; i < strlen(url); i++)
     {
         if( (url[i] < '0' || url[i] > '9') &&
@@ -28,101 +97,1043 @@ bool valid_url(const char* url)
     return true;
 }
 
-// This was shamlessly stolen off the internet 
-// Only works with \0 terminated strings
-static IRAM_ATTR bool wildcmp(const char *pattern, const char *string)
+static bool is_pattern(const char* entry)
 {
-    if(*pattern=='\0' && *string=='\0')
-        return true;
+    return strpbrk(entry, "*?") != NULL;
+}
 
-    if (*pattern == '*' && *(pattern+1) != '\0' && *string == '\0') 
-        return false; 
-		
-    if(*pattern=='?' || *pattern==*string)
-        return wildcmp(pattern+1,string+1);
-		
-    if(*pattern=='*')
-        return wildcmp(pattern+1,string) || wildcmp(pattern,string+1);
+// Split entry into the name stored in the index and its match flags,
+// "*.example.com" is stored as example.com matching all subdomains
+// and "@@" entries are allowlist entries
+static const char* index_name(const char* entry, size_t* len, uint8_t* flags)
+{
+    bool allow = false;
+    if( entry[0] == '@' && entry[1] == '@' )
+    {
+        entry += 2;
+        *len -= 2;
+        allow = true;
+    }
 
+    *flags = allow ? ALLOW_EXACT : MATCH_EXACT;
+    if( entry[0] == '*' && entry[1] == '.' )
+    {
+        entry += 2;
+        *len -= 2;
+        *flags = allow ? ALLOW_SUBDOMAINS : MATCH_SUBDOMAINS;
+    }
+    return entry;
+}
+
+// Allowlist flags for parsed exception flags
+static uint8_t allow_flags(uint8_t flags)
+{
+    return ((flags & MATCH_EXACT) ? ALLOW_EXACT : 0) | ((flags & MATCH_SUBDOMAINS) ? ALLOW_SUBDOMAINS : 0);
+}
+
+// Check prefilter for the name and each of its parents, false if none can be listed
+static IRAM_ATTR bool maybe_listed(const bloom_filter& prefilter, const domain_key& key)
+{
+    for( size_t i = key.labels; i-- > 0; )
+    {
+        if( prefilter.possibly_contains(key.hashes[i]) )
+            return true;
+    }
     return false;
 }
 
-IRAM_ATTR bool in_blacklist(const char* domain)
+static void count_hash(uint32_t hash, void* ctx)
+{
+    (*(size_t*)ctx)++;
+}
+
+static void add_hash(uint32_t hash, void* ctx)
+{
+    ((bloom_filter*)ctx)->add(hash);
+}
+
+// Size prefilter for every list with some room for new entries,
+// the blocklist image carries its own
+static void build_prefilter(list_snapshot& snapshot)
+{
+    size_t entries = 0;
+    snapshot.blacklist.for_each_hash(count_hash, &entries);
+
+    snapshot.prefilter.reset(entries + entries/8 + 64, MAX_PREFILTER_SIZE);
+    snapshot.blacklist.for_each_hash(add_hash, &snapshot.prefilter);
+    ESP_LOGI(TAG, "Prefilter: %d entries (%d bytes)", entries, snapshot.prefilter.memory());
+}
+
+static IRAM_ATTR list_snapshot* acquire_snapshot()
+{
+    portENTER_CRITICAL(&snapshot_mux);
+    list_snapshot* snapshot = current;
+    if( snapshot != NULL )
+        snapshot->references++;
+    portEXIT_CRITICAL(&snapshot_mux);
+    return snapshot;
+}
+
+static void free_snapshot(list_snapshot* snapshot)
+{
+    delete snapshot;
+}
+
+// Drop a reference, the snapshot is freed once it is neither published nor used
+static IRAM_ATTR void release_snapshot(list_snapshot* snapshot)
+{
+    portENTER_CRITICAL(&snapshot_mux);
+    bool unused = --snapshot->references == 0;
+    portEXIT_CRITICAL(&snapshot_mux);
+    if( unused )
+        free_snapshot(snapshot);
+}
+
+// Copy of the current snapshot to modify and publish, NULL if out of memory. list_mutex must
+// be held. Queries don't wait for the copy, it only reads what they leave unchanged
+static list_snapshot* copy_snapshot()
+{
+    list_snapshot* snapshot = NULL;
+    try{
+        snapshot = current != NULL ? new list_snapshot(*current) : new list_snapshot();
+
+        // Nodes of removed entries are freed once they outnumber the rest
+        if( snapshot->blacklist.erased_nodes() > snapshot->blacklist.entry_ids() / 2 )
+            snapshot->blacklist.compact();
+    }catch(const std::bad_alloc& e){
+        ESP_LOGE(TAG, "Not enough memory to copy blacklist");
+        free_snapshot(snapshot);
+        return NULL;
+    }
+    snapshot->references = 0;
+    return snapshot;
+}
+
+// Lists of snapshot blocking while only the given categories are enabled
+static uint16_t category_lists(const list_snapshot* snapshot, uint8_t categories)
+{
+    uint16_t lists = ALL_LISTS;
+    for( int i = 0; i < 16; i++ )
+    {
+        if( snapshot->categories[i] != 0 && !(snapshot->categories[i] & categories) )
+            lists &= ~(1 << i);
+    }
+    return lists;
+}
+
+// Swap snapshot in with a single pointer store, queries already running keep
+// the old one, which is freed by whichever of them releases it last.
+// list_mutex must be held
+static void publish_snapshot(list_snapshot* snapshot)
+{
+    snapshot->references = 1;
+    snapshot->version = ++published;
+    uint16_t lists = category_lists(snapshot, categories);
+    portENTER_CRITICAL(&snapshot_mux);
+    std::swap(snapshot, current);
+    enabled_lists = lists;
+    portEXIT_CRITICAL(&snapshot_mux);
+    invalidate_verdicts();
+    if( snapshot != NULL )
+        release_snapshot(snapshot);
+}
+
+// Default rule for name with one MATCH_* flag, -1 if it isn't one
+static int default_rule_of(const char* name, size_t len, uint8_t flag)
+{
+    if( !is_pattern(name) )
+        return find_default_domain(name, len, flag);
+    return find_default_pattern(flag == MATCH_SUBDOMAINS ? (std::string("*.") + name).c_str() : name);
+}
+
+// Enable or disable the default rules among the MATCH_* flags of name in an unpublished
+// snapshot, they take a bit instead of an entry. Returns the flags that aren't default rules
+static uint8_t set_default_rules(list_snapshot& snapshot, const char* name, size_t len, uint8_t flags, bool enable, bool* changed)
+{
+    static const uint8_t kinds[] = { MATCH_EXACT, MATCH_SUBDOMAINS };
+    for( size_t i = 0; i < sizeof(kinds); i++ )
+    {
+        int rule = (flags & kinds[i]) ? default_rule_of(name, len, kinds[i]) : -1;
+        if( rule < 0 )
+            continue;
+        if( snapshot.defaults.empty() )
+            snapshot.defaults.resize(default_rule_count());
+        *changed |= snapshot.defaults[rule] != enable;
+        snapshot.defaults[rule] = enable;
+        flags &= ~kinds[i];
+    }
+    return flags;
+}
+
+// Add normalized name with MATCH_* flags from lists to an unpublished snapshot
+static bool add_name(list_snapshot& snapshot, const char* name, size_t len, uint8_t flags, uint16_t lists)
+{
+    bool added = false;
+    if( lists == USER_LIST )
+    {
+        flags = set_default_rules(snapshot, name, len, flags, true, &added);
+        if( flags == 0 )
+            return added;
+    }
+
+    if( is_pattern(name) )
+    {
+        // Allowlist only holds domains
+        if( flags & (ALLOW_EXACT | ALLOW_SUBDOMAINS) )
+            return false;
+
+        if( flags & MATCH_EXACT )
+            added |= snapshot.patterns.add(name, lists);
+        if( flags & MATCH_SUBDOMAINS )
+            added |= snapshot.patterns.add((std::string("*.") + name).c_str(), lists);
+        return added;
+    }
+    if( !snapshot.blacklist.insert(name, len, flags, lists) )
+        return added;
+
+    // Allow entries too, a name missing the prefilter is neither blocked nor allowed by the index
+    snapshot.prefilter.add(domain_hash(name, len));
+    if( snapshot.prefilter.full() )
+        build_prefilter(snapshot);
+    return true;
+}
+
+// Add normalized entry of blacklist.txt to an unpublished snapshot
+static bool add_entry(list_snapshot& snapshot, const char* entry, size_t len)
+{
+    uint8_t flags;
+    const char* name = index_name(entry, &len, &flags);
+    if( is_pattern(name) )
+    {
+        bool added = false;
+        if( set_default_rules(snapshot, name, len, flags, true, &added) == 0 )
+            return added;
+        return (flags & (MATCH_EXACT | MATCH_SUBDOMAINS)) ? snapshot.patterns.add(entry, USER_LIST) : false;
+    }
+    return add_name(snapshot, name, len, flags, USER_LIST);
+}
+
+// Remove normalized entry from an unpublished snapshot
+static bool remove_entry(list_snapshot& snapshot, const char* entry, size_t len)
+{
+    uint8_t flags;
+    const char* name = index_name(entry, &len, &flags);
+    bool removed = false;
+    if( set_default_rules(snapshot, name, len, flags, false, &removed) == 0 )
+        return removed;
+    if( is_pattern(name) )
+    {
+        return (flags & (MATCH_EXACT | MATCH_SUBDOMAINS)) ? snapshot.patterns.remove(entry) : false;
+    }
+    return snapshot.blacklist.erase(name, len, flags, USER_LIST);
+}
+
+static size_t read_journal(std::map<std::string, bool>& changes);
+static void compact_task(void* parameters);
+
+struct parsed_list {
+    list_snapshot* snapshot;
+    uint16_t lists;
+};
+
+static void add_parsed(const char* name, size_t len, uint8_t flags, void* ctx)
+{
+    if( flags & ENTRY_EXCEPTION )
+        flags = allow_flags(flags);
+    parsed_list* list = (parsed_list*)ctx;
+    add_name(*list->snapshot, name, len, flags, list->lists);
+}
+
+// Add every entry of a list file in any format the parser knows to an unpublished snapshot,
+// starting at offset start
+static void load_list(list_snapshot& snapshot, const std::string& path, uint16_t lists)
+{
+    using namespace fs;
+    file list = open(path, "r");
+
+    parsed_list ctx = { &snapshot, lists };
+    list_parser parser(add_parsed, &ctx);
+    char buffer[1024];
+    size_t size;
+    while( (size = list.read(buffer, 1, sizeof(buffer))) > 0 )
+        parser.feed(buffer, size);
+    parser.finish();
+
+    if( parser.skipped_count() > 0 )
+        ESP_LOGW(TAG, "Skipped %d lines of %s", parser.skipped_count(), path.c_str());
+}
+
+// Add the downloaded copy of every subscribed list to an unpublished snapshot
+static void load_subscribed_lists(list_snapshot& snapshot)
+{
+    std::vector<subscribed_list> subscribed = subscription_files();
+    for( size_t i = 0; i < subscribed.size() && i < MAX_SUBSCRIPTION_LISTS; i++ )
+    {
+        // Bit i+1, after USER_LIST
+        snapshot.categories[i + 1] = subscribed[i].categories;
+        if( subscribed[i].path.empty() )
+            continue;
+        try{
+            load_list(snapshot, subscribed[i].path, SUBSCRIPTION_LIST(i));
+        }catch(const Err& e){
+            ESP_LOGE(TAG, "Unable to load %s", subscribed[i].path.c_str());
+        }
+    }
+}
+
+esp_err_t initialize_blocklists()
 {
-    ESP_LOGD(TAG, "Checking Blacklist for %s", domain);
     int64_t start = esp_timer_get_time();
+    if( list_mutex == NULL )
+    {
+        list_mutex = xSemaphoreCreateMutex();
+        file_mutex = xSemaphoreCreateMutex();
+        pattern_mutex = xSemaphoreCreateMutex();
+        import_mutex = xSemaphoreCreateMutex();
+        if( list_mutex == NULL || file_mutex == NULL || pattern_mutex == NULL || import_mutex == NULL )
+            return ESP_ERR_NO_MEM;
+    }
 
-    bool inBlacklist = false;
+    // Queries keep using the current lists while the new ones are loaded
+    xSemaphoreTake(file_mutex, portMAX_DELAY);
+    xSemaphoreTake(list_mutex, portMAX_DELAY);
+    list_snapshot* snapshot = new (std::nothrow) list_snapshot();
+    if( snapshot == NULL )
+    {
+        xSemaphoreGive(list_mutex);
+        xSemaphoreGive(file_mutex);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
     try{
-        using namespace fs;
-        file blacklist = open("/blacklist.txt", "r");
+        load_list(*snapshot, "/blacklist.txt", USER_LIST);
+    }catch(const Err& e){
+        err = ESP_FAIL;
+    }
+
+    load_subscribed_lists(*snapshot);
 
-        char entry[255];
-        while( fgets(entry, 255, blacklist.handle) != NULL )
+    // Replay edits that haven't been compacted into blacklist.txt yet
+    try{
+        std::map<std::string, bool> changes;
+        journal_records = read_journal(changes);
+        for( std::map<std::string, bool>::iterator it = changes.begin(); it != changes.end(); it++ )
         {
-            entry[strcspn(entry, "\r")] = 0;
-            entry[strcspn(entry, "\n")] = 0;
-            if( wildcmp(entry, domain) )
-            {
-                inBlacklist = true;
-                break;
-            }
+            if( it->second )
+                add_entry(*snapshot, it->first.c_str(), it->first.size());
+            else
+                remove_entry(*snapshot, it->first.c_str(), it->first.size());
         }
     }catch(const Err& e){
-        inBlacklist = false;
+        ESP_LOGE(TAG, "Unable to read journal");
     }
+    build_prefilter(*snapshot);
+
+    size_t domains = snapshot->blacklist.size();
+    size_t patterns = snapshot->patterns.size();
+    size_t memory = snapshot->blacklist.memory() + snapshot->patterns.memory();
+    publish_snapshot(snapshot);
+    xSemaphoreGive(list_mutex);
+    xSemaphoreGive(file_mutex);
+
+    if( compact_task_handle == NULL )
+        xTaskCreatePinnedToCore(compact_task, "compact_task", 4096, NULL, 1, &compact_task_handle, tskNO_AFFINITY);
+    if( journal_records > 0 && compact_task_handle != NULL )
+        xTaskNotifyGive(compact_task_handle);
 
     int64_t end = esp_timer_get_time();
-    ESP_LOGD(TAG, "Processing Time: %lld ms", (end-start)/1000);
+    ESP_LOGI(TAG, "Loaded %d domains & %d patterns in %lld ms (%d bytes)", domains, patterns, (end-start)/1000, memory);
+    return err;
+}
 
-    return inBlacklist;
+// Count a hit of rule, an index entry or PATTERN_RULE and the pattern index
+// of snapshot
+static IRAM_ATTR void count_rule(const list_snapshot* snapshot, uint32_t rule)
+{
+    if( rule == NO_MATCH )
+        return;
+    if( rule & PATTERN_RULE )
+        snapshot->patterns.count_hit(rule & ~PATTERN_RULE);
+    else
+        snapshot->blacklist.count_hit(rule);
 }
 
-esp_err_t add_to_blacklist(const char* hostname)
+// Every list blocking key's name, sources are checked in order of cost.
+// rule is set to the index entry or pattern deciding the verdict, NO_MATCH if 
+// there is none or the name is only blocked by a default rule or the image, and
+// version to the snapshot it is in
+static IRAM_ATTR uint16_t match_lists(const domain_key& key, uint32_t* rule, uint32_t* version)
 {
-    // Check url validity
-    if ( !valid_url(hostname) )
-        return URL_ERR_INVALID_URL;
+    *rule = NO_MATCH;
+    *version = 0;
+    list_snapshot* snapshot = acquire_snapshot();
+    if( snapshot == NULL )
+    {
+        // Lists aren't loaded before the filesystem is, default rules don't need it
+        return match_default_rules(key, NULL) >= 0 ? USER_LIST : 0;
+    }
+
+    *version = snapshot->version;
+
+    // Allowlist entries are in the same index, one walk finds all lists blocking
+    // the name. An allow match also overrides patterns and the image.
+    // Allow entries are in the prefilter, so without a hit no index entry applies.
+    // Patterns take their own pass through the DFA
+    bool maybe = maybe_listed(snapshot->prefilter, key);
+    bool allowed = false;
+    uint16_t lists = 0;
+    bool has_patterns = snapshot->patterns.size() > 0;
+    bool by_default = match_default_rules(key, &snapshot->defaults) >= 0;
+    if( maybe || by_default )
+        lists = snapshot->blacklist.match(key, &allowed, rule);
+    if( !allowed && by_default )
+        lists |= USER_LIST;
+    if( !allowed && has_patterns )
+    {
+        uint16_t pattern_lists;
+        xSemaphoreTake(pattern_mutex, portMAX_DELAY);
+        uint32_t pattern = snapshot->patterns.match(key.name, key.len, &pattern_lists);
+        xSemaphoreGive(pattern_mutex);
+        if( pattern != NO_MATCH && *rule == NO_MATCH )
+            *rule = PATTERN_RULE | pattern;
+        lists |= pattern_lists;
+    }
+    count_rule(snapshot, *rule);
+    release_snapshot(snapshot);
+
+    if( !allowed && in_list_image(key) )
+        lists |= IMAGE_LIST;
+    return lists;
+}
+
+// Hash of the whole name independent of the suffix hash, together they key the
+// verdict cache so a collision of one doesn't return another name's verdict
+static IRAM_ATTR uint32_t name_check(const domain_key& key)
+{
+    uint32_t hash = 0x9747B28C;
+    for( size_t i = 0; i < key.len; i++ )
+    {
+        hash = (hash ^ (uint8_t)key.name[i]) * 0x5BD1E995;
+        hash ^= hash >> 15;
+    }
+    return hash;
+}
+
+// Lists out of wanted blocking key's name. Every list is looked up on a miss, so one
+// cached verdict serves clients of every policy group
+static IRAM_ATTR uint16_t lookup(const domain_key& key, uint16_t wanted)
+{
+    ESP_LOGD(TAG, "Checking Blacklist for %s", key.name);
+    int64_t start = esp_timer_get_time();
+
+    if( key.len == 0 || wanted == 0 )
+        return 0;
+    size_t len = key.len;
+    uint32_t hash = key.hashes[0];
+    uint32_t check = name_check(key);
 
+    // Generation is read before the lists, a verdict from lists replaced in 
+    // the meantime is stored with an old generation and never used
+    verdict& cached = verdicts[hash & (VERDICT_CACHE_SIZE - 1)];
+    portENTER_CRITICAL(&verdict_mux);
+    uint32_t generation = verdict_generation;
+    bool hit = cached.generation == generation && cached.hash == hash &&
+               cached.check == check && cached.len == len;
+    uint16_t lists = cached.lists;
+    uint32_t rule = cached.rule;
+    uint32_t version = cached.version;
+    portEXIT_CRITICAL(&verdict_mux);
+
+    if( hit )
+    {
+        // Ids change when the index is compacted, hits of a replaced snapshot are dropped
+        list_snapshot* snapshot = acquire_snapshot();
+        if( snapshot != NULL )
+        {
+            if( snapshot->version == version )
+                count_rule(snapshot, rule);
+            release_snapshot(snapshot);
+        }
+    }
+    else
+    {
+        lists = match_lists(key, &rule, &version);
+        portENTER_CRITICAL(&verdict_mux);
+        cached.hash = hash;
+        cached.check = check;
+        cached.generation = generation;
+        cached.rule = rule;
+        cached.version = version;
+        cached.lists = lists;
+        cached.len = len;
+        portEXIT_CRITICAL(&verdict_mux);
+    }
+
+    int64_t end = esp_timer_get_time();
+    ESP_LOGD(TAG, "Processing Time: %lld us%s", end-start, hit ? " (cached)" : "");
+
+    return lists & wanted & enabled_lists;
+}
+
+IRAM_ATTR bool in_blacklist(const char* domain, uint16_t lists)
+{
+    domain_key key;
+    make_domain_key(domain, &key);
+    return lookup(key, lists) != 0;
+}
+
+IRAM_ATTR bool in_blacklist(const domain_key& key, uint16_t lists)
+{
+    return lookup(key, lists) != 0;
+}
+
+IRAM_ATTR uint16_t blocking_lists(const char* domain)
+{
+    domain_key key;
+    make_domain_key(domain, &key);
+    return lookup(key, ALL_LISTS);
+}
+
+IRAM_ATTR uint16_t blocking_lists(const domain_key& key)
+{
+    return lookup(key, ALL_LISTS);
+}
+
+int parse_categories(const char* names)
+{
+    static const struct { const char* name; uint8_t flag; } known[] = {
+        { "ads", CATEGORY_ADS }, { "tracking", CATEGORY_TRACKING }, 
+        { "malware", CATEGORY_MALWARE }, { "adult", CATEGORY_ADULT }
+    };
+
+    int flags = 0;
+    std::string copy(names);
+    char* save;
+    for( char* name = strtok_r(&copy[0], ",", &save); name != NULL; name = strtok_r(NULL, ",", &save) )
+    {
+        size_t i = 0;
+        while( i < sizeof(known)/sizeof(known[0]) && strcmp(name, known[i].name) != 0 )
+            i++;
+        if( i == sizeof(known)/sizeof(known[0]) )
+            return -1;
+        flags |= known[i].flag;
+    }
+    return flags;
+}
+
+// Verdicts hold every blocking list, switching categories only changes the mask
+// applied to them, so nothing is reloaded or invalidated
+void set_enabled_categories(uint8_t enabled)
+{
+    if( list_mutex != NULL )
+        xSemaphoreTake(list_mutex, portMAX_DELAY);
+    categories = enabled & ALL_CATEGORIES;
+    portENTER_CRITICAL(&snapshot_mux);
+    if( current != NULL )
+        enabled_lists = category_lists(current, categories);
+    portEXIT_CRITICAL(&snapshot_mux);
+    if( list_mutex != NULL )
+        xSemaphoreGive(list_mutex);
+    ESP_LOGI(TAG, "Enabled categories: %02x", categories);
+}
+
+uint8_t enabled_categories()
+{
+    return categories;
+}
+
+void invalidate_verdicts()
+{
+    portENTER_CRITICAL(&verdict_mux);
+    verdict_generation++;
+    portEXIT_CRITICAL(&verdict_mux);
+}
+
+// Append add ('+') or remove ('-') record to the journal, file_mutex must be held
+static esp_err_t journal_append(char op, const char* entry)
+{
     try{
         using namespace fs;
-        file blacklist = open("/blacklist.txt", "a");
-
-        fputs(hostname, blacklist.handle);
-        fputc('\n', blacklist.handle);
-    }catch(std::string e){
+        file journal = open(JOURNAL_PATH, "a");
+        if( fputc(op, journal.handle) == EOF || fputs(entry, journal.handle) == EOF ||
+            fputc('\n', journal.handle) == EOF || fflush(journal.handle) != 0 )
+        {
+            ESP_LOGE(TAG, "Unable to write %s", JOURNAL_PATH);
+            return ESP_FAIL;
+        }
+        journal_records++;
+    }catch(const Err& e){
         return ESP_FAIL;
     }
-    
     return ESP_OK;
 }
 
-static bool remove_hostname(const char* hostname)
+// Apply an edit to a copy of the lists, journal it and publish the copy, false if nothing
+// changed. The lists are left as they were if the edit can't be journaled
+static bool edit_lists(const char* entry, size_t len, bool add, esp_err_t* err)
+{
+    xSemaphoreTake(file_mutex, portMAX_DELAY);
+    xSemaphoreTake(list_mutex, portMAX_DELAY);
+    list_snapshot* snapshot = copy_snapshot();
+    bool changed = false;
+    *err = snapshot == NULL ? ESP_ERR_NO_MEM : ESP_OK;
+    if( snapshot != NULL )
+    {
+        try{
+            changed = add ? add_entry(*snapshot, entry, len) : remove_entry(*snapshot, entry, len);
+        }catch(const std::bad_alloc& e){
+            ESP_LOGE(TAG, "Not enough memory to edit blacklist");
+            *err = ESP_ERR_NO_MEM;
+            changed = false;
+        }
+        if( changed )
+        {
+            *err = journal_append(add ? '+' : '-', entry);
+            changed = *err == ESP_OK;
+        }
+        if( changed )
+            publish_snapshot(snapshot);
+        else
+            free_snapshot(snapshot);
+    }
+    xSemaphoreGive(list_mutex);
+    xSemaphoreGive(file_mutex);
+
+    if( changed && compact_task_handle != NULL )
+        xTaskNotifyGive(compact_task_handle);
+    return changed;
+}
+
+struct import_ctx {
+    fs::file* list;
+    bool failed;
+};
+
+// Write imported entry to the saved upload as a plain entry
+static void write_imported(const char* name, size_t len, uint8_t flags, void* ctx)
+{
+    import_ctx* import = (import_ctx*)ctx;
+    const char* prefix = (flags & ENTRY_EXCEPTION) ? "@@" : "";
+    if( (flags & MATCH_EXACT) && fprintf(import->list->handle, "%s%s\n", prefix, name) < 0 )
+        import->failed = true;
+    if( (flags & MATCH_SUBDOMAINS) && fprintf(import->list->handle, "%s*.%s\n", prefix, name) < 0 )
+        import->failed = true;
+}
+
+// Remove what was saved of a failed import, import_mutex must be held
+static void discard_import()
+{
+    try{
+        if( fs::exists(IMPORT_PATH) )
+            fs::unlink(IMPORT_PATH);
+    }catch(const Err& e){
+        ESP_LOGE(TAG, "Unable to remove %s", IMPORT_PATH);
+    }
+}
+
+// Copy a whole file to the end of another one
+static void append_file(fs::file& to, const char* path)
+{
+    fs::file from = fs::open(path, "r");
+    char buffer[1024];
+    size_t size;
+    while( (size = from.read(buffer, 1, sizeof(buffer))) > 0 )
+        to.write(buffer, 1, size);
+}
+
+// Move the saved upload into blacklist.txt, file_mutex must be held
+static void save_import(bool append)
 {
     using namespace fs;
-    file blacklist = open("/blacklist.txt", "r");
-    file tmp = open("/tmplist", "w");
+    if( append && exists("/blacklist.txt") )
+    {
+        // Merged into a copy, blacklist.txt stays as it was if flash is full
+        bool written;
+        try{
+            file merged = open("/tmplist", "w");
+            append_file(merged, "/blacklist.txt");
+            append_file(merged, IMPORT_PATH);
+            written = fflush(merged.handle) == 0;
+        }catch(const Err& e){
+            written = false;
+        }
+        if( !written )
+        {
+            if( exists("/tmplist") )
+                unlink("/tmplist");
+            THROWE(ESP_FAIL, "Unable to write %s", "/tmplist");
+        }
+        unlink("/blacklist.txt");
+        rename("/tmplist", "/blacklist.txt");
+        unlink(IMPORT_PATH);
+        return;
+    }
 
-    // Copy every url in blacklist to tmplist, except url to be removed
-    bool found_url = false;
-    char buffer[MAX_URL_LENGTH+1];
-    while( fgets(buffer, MAX_URL_LENGTH, blacklist.handle) )
+    if( exists("/blacklist.txt") )
+        unlink("/blacklist.txt");
+    rename(IMPORT_PATH, "/blacklist.txt");
+
+    // Journaled edits were made to the replaced list
+    if( !append && exists(JOURNAL_PATH) )
+        unlink(JOURNAL_PATH);
+    if( !append )
+        journal_records = 0;
+}
+
+// Index the saved upload, and the subscribed lists unless it is appended
+static esp_err_t load_import(list_snapshot* snapshot, bool append)
+{
+    if( snapshot == NULL )
+        return ESP_ERR_NO_MEM;
+    try{
+        load_list(*snapshot, IMPORT_PATH, USER_LIST);
+        if( !append )
+            load_subscribed_lists(*snapshot);
+        build_prefilter(*snapshot);
+    }catch(const Err& e){
+        return ESP_FAIL;
+    }catch(const std::bad_alloc& e){
+        ESP_LOGE(TAG, "Not enough memory for upload");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t import_blacklist(list_reader read, void* ctx, bool append)
+{
+    if( list_mutex == NULL )
+        return ESP_FAIL;
+
+    // The upload is saved to flash without file_mutex, edits don't wait for the network
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(import_mutex, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    size_t entries = 0;
+    try{
+        using namespace fs;
+        file list = open(IMPORT_PATH, "w");
+
+        // Entries are parsed as they arrive, only normalized ones are written once
+        import_ctx import = { &list, false };
+        list_parser parser(write_imported, &import, true);
+        char buffer[1024];
+        int size;
+        while( (size = read(buffer, sizeof(buffer), ctx)) > 0 && !import.failed )
+            parser.feed(buffer, size);
+        parser.finish();
+        entries = parser.entry_count();
+        if( size < 0 )
+            err = ESP_FAIL;
+        else if( import.failed || fflush(list.handle) != 0 || ferror(list.handle) )
+        {
+            ESP_LOGE(TAG, "Unable to write %s", IMPORT_PATH);
+            err = ESP_FAIL;
+        }
+        else if( parser.skipped_count() > 0 )
+            ESP_LOGW(TAG, "Skipped %d lines of upload", parser.skipped_count());
+    }catch(const Err& e){
+        err = ESP_FAIL;
+    }catch(const std::bad_alloc& e){
+        ESP_LOGE(TAG, "Not enough memory for upload");
+        err = ESP_ERR_NO_MEM;
+    }
+
+    // A replacing list doesn't depend on the current one and is indexed before locking,
+    // appended entries are added to a copy of the current lists while they are locked
+    list_snapshot* snapshot = NULL;
+    if( err == ESP_OK && !append )
+    {
+        snapshot = new (std::nothrow) list_snapshot();
+        err = load_import(snapshot, false);
+    }
+    if( err == ESP_OK )
     {
-        strtok(buffer, "\r\n");
-        ESP_LOGD(TAG, "Read %s from blacklist.txt", buffer);
-        if( strcmp( buffer, hostname) != 0 )
+        xSemaphoreTake(file_mutex, portMAX_DELAY);
+        xSemaphoreTake(list_mutex, portMAX_DELAY);
+        if( append )
         {
-            fputs(buffer, tmp.handle);
-            fputc('\n', tmp.handle);
+            snapshot = copy_snapshot();
+            err = load_import(snapshot, true);
         }
-        else
+        if( err == ESP_OK )
+        {
+            try{
+                save_import(append);
+            }catch(const Err& e){
+                err = ESP_FAIL;
+            }
+        }
+        if( err == ESP_OK )
+            publish_snapshot(snapshot);
+        xSemaphoreGive(list_mutex);
+        xSemaphoreGive(file_mutex);
+    }
+
+    if( err != ESP_OK )
+    {
+        if( snapshot != NULL )
+            free_snapshot(snapshot);
+        discard_import();
+    }
+    xSemaphoreGive(import_mutex);
+
+    if( err == ESP_OK )
+        ESP_LOGI(TAG, "Imported %d entries in %lld ms", entries, (esp_timer_get_time()-start)/1000);
+    return err;
+}
+
+struct export_ctx {
+    std::string lines;
+    list_writer write;
+    void* ctx;
+    bool failed;
+};
+
+// Pass collected lines on to the writer, no list or image may be locked
+static void flush_export(export_ctx& out)
+{
+    if( !out.failed && !out.lines.empty() )
+        out.failed = !out.write(out.lines.data(), out.lines.size(), out.ctx);
+    out.lines.clear();
+}
+
+// Append entry as blacklist.txt lines, each followed by end
+static void append_rule(std::string& out, const char* name, size_t len, uint8_t flags, char end)
+{
+    static const struct { uint8_t flag; const char* prefix; } forms[] = {
+        { MATCH_EXACT, "" }, { MATCH_SUBDOMAINS, "*." }, { ALLOW_EXACT, "@@" }, { ALLOW_SUBDOMAINS, "@@*." }
+    };
+
+    for( size_t i = 0; i < sizeof(forms)/sizeof(forms[0]); i++ )
+    {
+        if( flags & forms[i].flag )
         {
-            ESP_LOGD(TAG, "Found match");
-            found_url = true;
+            out.append(forms[i].prefix);
+            out.append(name, len);
+            out += end;
         }
     }
+}
 
-    return found_url;
+// Append entry to the export, written once the caller unlocked what it reads from
+static void export_entry(const char* name, size_t len, uint8_t flags, void* ctx)
+{
+    export_ctx* out = (export_ctx*)ctx;
+    append_rule(out->lines, name, len, flags, '\n');
+}
+
+// Append entries of snapshot to out until it holds a chunk, index entries from id *entry on,
+// then patterns and default rules. False once everything was appended
+static bool export_chunk(const list_snapshot* snapshot, std::string& out, uint32_t* entry)
+{
+    const domain_index& index = snapshot->blacklist;
+    char name[256];
+    for( ; *entry < index.entry_ids() && out.size() < EXPORT_CHUNK_SIZE; (*entry)++ )
+    {
+        uint8_t flags;
+        size_t len = index.entry_name(*entry, name, &flags);
+        append_rule(out, name, len, flags, '\n');
+    }
+    if( *entry < index.entry_ids() )
+        return true;
+
+    for( size_t i = 0; i < snapshot->patterns.size(); i++ )
+    {
+        const std::string& pattern = snapshot->patterns[i];
+        append_rule(out, pattern.c_str(), pattern.size(), MATCH_EXACT, '\n');
+    }
+    for( size_t i = 0; i < snapshot->defaults.size(); i++ )
+    {
+        if( snapshot->defaults[i] )
+            append_rule(out, default_rule(i), strlen(default_rule(i)), MATCH_EXACT, '\n');
+    }
+    return false;
+}
+
+esp_err_t export_blacklist(list_writer write, void* ctx)
+{
+    export_ctx out;
+    out.write = write;
+    out.ctx = ctx;
+    out.failed = false;
+
+    // The snapshot is only held while a chunk is collected, so it is never kept
+    // while waiting for the writer. Publishing other lists ends the export
+    esp_err_t err = ESP_OK;
+    uint32_t version = 0;
+    uint32_t entry = 0;
+    bool more = true;
+    try{
+        out.lines.reserve(EXPORT_CHUNK_SIZE + 2*MAX_URL_LENGTH);
+        while( more && err == ESP_OK && !out.failed )
+        {
+            list_snapshot* snapshot = acquire_snapshot();
+            if( snapshot == NULL )
+                break;
+            if( version == 0 )
+            {
+                version = snapshot->version;
+                out.lines.append("# blacklist.txt & subscriptions\n");
+            }
+
+            if( snapshot->version != version )
+                err = ESP_ERR_INVALID_STATE;
+            else
+            {
+                try{
+                    more = export_chunk(snapshot, out.lines, &entry);
+                }catch(const std::bad_alloc& e){
+                    err = ESP_ERR_NO_MEM;
+                }
+            }
+            release_snapshot(snapshot);
+
+            if( err == ESP_OK )
+                flush_export(out);
+        }
+    }catch(const std::bad_alloc& e){
+        err = ESP_ERR_NO_MEM;
+    }
+
+    // Image is read a block at a time, lookups only wait for one block. Its first
+    // byte is only there if an image is loaded
+    uint32_t checksum = 0;
+    char first;
+    try{
+        if( err == ESP_OK && !out.failed && read_list_image(0, &first, 1, &checksum) > 0 )
+        {
+            out.lines.append("# blocklist image\n");
+            int read = 1;
+            for( size_t block = 0; err == ESP_OK && !out.failed && read > 0; block++ )
+            {
+                read = read_list_image_block(block, export_entry, &out, &checksum);
+                if( read < 0 )
+                    err = ESP_ERR_INVALID_STATE;
+                else
+                    flush_export(out);
+            }
+        }
+    }catch(const std::bad_alloc& e){
+        err = ESP_ERR_NO_MEM;
+    }
+
+    if( err == ESP_OK && out.failed )
+        err = ESP_FAIL;
+    if( err != ESP_OK )
+        ESP_LOGW(TAG, "Export stopped, %s", esp_err_to_name(err));
+    return err;
+}
+
+struct rule_count {
+    uint32_t hits;
+    uint32_t rule;
+};
+
+static bool more_hits(const rule_count& a, const rule_count& b)
+{
+    return a.hits > b.hits;
+}
+
+struct top_ctx {
+    std::vector<rule_count> top;                // Heap, rule with fewest hits first
+    size_t limit;
+    size_t rules;
+    size_t unused;
+};
+
+static void add_top(top_ctx& top, uint32_t rule, uint32_t hits)
+{
+    top.rules++;
+    if( hits == 0 )
+        top.unused++;
+
+    rule_count count = { hits, rule };
+    if( top.top.size() < top.limit )
+    {
+        top.top.push_back(count);
+        std::push_heap(top.top.begin(), top.top.end(), more_hits);
+    }
+    else if( top.limit > 0 && hits > top.top.front().hits )
+    {
+        std::pop_heap(top.top.begin(), top.top.end(), more_hits);
+        top.top.back() = count;
+        std::push_heap(top.top.begin(), top.top.end(), more_hits);
+    }
+}
+
+static void add_top_entry(uint32_t entry, uint32_t hits, void* ctx)
+{
+    add_top(*(top_ctx*)ctx, entry, hits);
+}
+
+esp_err_t top_rules(size_t limit, rule_callback fn, void* ctx, size_t* rules, size_t* unused)
+{
+    top_ctx top;
+    top.limit = std::min(limit, (size_t)MAX_TOP_RULES);
+    top.rules = 0;
+    top.unused = 0;
+    std::vector<std::string> names;
+
+    // Only the top rules are held while counting, their names are built at the end
+    esp_err_t err = ESP_OK;
+    list_snapshot* snapshot = acquire_snapshot();
+    try{
+        top.top.reserve(top.limit);
+        if( snapshot != NULL )
+        {
+            snapshot->blacklist.for_each_hit(add_top_entry, &top);
+            for( size_t i = 0; i < snapshot->patterns.size(); i++ )
+                add_top(top, PATTERN_RULE | i, snapshot->patterns.hit_count(i));
+
+            std::sort_heap(top.top.begin(), top.top.end(), more_hits);
+            names.resize(top.top.size());
+            char name[256];
+            for( size_t i = 0; i < top.top.size(); i++ )
+            {
+                uint32_t rule = top.top[i].rule;
+                if( rule & PATTERN_RULE )
+                {
+                    names[i] = snapshot->patterns[rule & ~PATTERN_RULE];
+                    continue;
+                }
+                uint8_t flags;
+                size_t len = snapshot->blacklist.entry_name(rule, name, &flags);
+                append_rule(names[i], name, len, flags, ' ');
+                if( !names[i].empty() )
+                    names[i].erase(names[i].size() - 1);
+            }
+        }
+    }catch(const std::bad_alloc& e){
+        err = ESP_ERR_NO_MEM;
+    }
+    if( snapshot != NULL )
+        release_snapshot(snapshot);
+    if( err != ESP_OK )
+        return err;
+
+    for( size_t i = 0; i < names.size(); i++ )
+        fn(names[i].c_str(), top.top[i].hits, ctx);
+    *rules = top.rules;
+    *unused = top.unused;
+    return ESP_OK;
+}
+
+esp_err_t add_to_blacklist(const char* hostname)
+{
+    // Check url validity
+    if ( !valid_url(hostname) )
+        return URL_ERR_INVALID_URL;
+
+    char entry[MAX_URL_LENGTH+1];
+    if( strlen(hostname) > MAX_URL_LENGTH )
+        return URL_ERR_TOO_LONG;
+    size_t len = normalize_domain(hostname, entry);
+
+    // Nothing is journaled if it is already in blacklist
+    esp_err_t err;
+    edit_lists(entry, len, true, &err);
+    return err;
 }
 
 esp_err_t remove_from_blacklist(const char* hostname)
@@ -131,17 +1142,172 @@ esp_err_t remove_from_blacklist(const char* hostname)
     if ( !valid_url(hostname) )
         return URL_ERR_INVALID_URL;
 
-    bool found_url = false;
-    try{
-        found_url = remove_hostname(hostname);
-        fs::unlink("/blacklist.txt");
-        fs::rename("/tmplist", "/blacklist.txt");
-    } catch(std::string e) {
+    char entry[MAX_URL_LENGTH+1];
+    if( strlen(hostname) > MAX_URL_LENGTH )
+        return URL_ERR_TOO_LONG;
+    size_t len = normalize_domain(hostname, entry);
+
+    esp_err_t err;
+    bool removed = edit_lists(entry, len, false, &err);
+    if( !removed )
+        return err == ESP_OK ? URL_ERR_NOT_FOUND : err;
+    return ESP_OK;
+}
+
+esp_err_t add_to_allowlist(const char* hostname)
+{
+    if( strlen(hostname) + 2 > MAX_URL_LENGTH )
+        return URL_ERR_TOO_LONG;
+    return add_to_blacklist((std::string("@@") + hostname).c_str());
+}
+
+esp_err_t remove_from_allowlist(const char* hostname)
+{
+    if( strlen(hostname) + 2 > MAX_URL_LENGTH )
+        return URL_ERR_TOO_LONG;
+    return remove_from_blacklist((std::string("@@") + hostname).c_str());
+}
+
+// Read journal into the final state of each entry it touches, true if added
+static size_t read_journal(std::map<std::string, bool>& changes)
+{
+    using namespace fs;
+    if( !exists(JOURNAL_PATH) )
+        return 0;
+
+    file journal = open(JOURNAL_PATH, "r");
+    size_t records = 0;
+    char record[MAX_URL_LENGTH+3];
+    while( fgets(record, sizeof(record), journal.handle) != NULL )
+    {
+        record[strcspn(record, "\r\n")] = 0;
+        if( (record[0] == '+' || record[0] == '-') && record[1] != '\0' )
+        {
+            changes[record+1] = (record[0] == '+');
+            records++;
+        }
+    }
+    return records;
+}
+
+struct compact_ctx {
+    std::map<std::string, bool>* changes;
+    fs::file* list;
+    bool failed;
+};
+
+// Write entry of blacklist.txt as plain entries, leaving out the ones the journal removes.
+// Entries the journal adds that are already there are dropped from changes
+static void compact_entry(const char* name, size_t len, uint8_t flags, void* ctx)
+{
+    static const uint8_t forms[] = { MATCH_EXACT, MATCH_SUBDOMAINS, ALLOW_EXACT, ALLOW_SUBDOMAINS };
+    compact_ctx* compact = (compact_ctx*)ctx;
+    if( flags & ENTRY_EXCEPTION )
+        flags = allow_flags(flags);
+
+    for( size_t i = 0; i < sizeof(forms); i++ )
+    {
+        if( !(flags & forms[i]) )
+            continue;
+        std::string line;
+        append_rule(line, name, len, forms[i], '\n');
+        std::map<std::string, bool>::iterator it = compact->changes->find(line.substr(0, line.size() - 1));
+        if( it != compact->changes->end() )
+        {
+            if( !it->second )
+                continue;
+            compact->changes->erase(it);
+        }
+        if( fputs(line.c_str(), compact->list->handle) == EOF )
+            compact->failed = true;
+    }
+}
+
+// Merge journal into blacklist.txt, file_mutex must be held
+static void compact()
+{
+    using namespace fs;
+    std::map<std::string, bool> changes;
+    read_journal(changes);
+    if( changes.empty() )
+    {
+        if( exists(JOURNAL_PATH) )
+            unlink(JOURNAL_PATH);
+        journal_records = 0;
+        return;
+    }
+
+    bool written;
+    {
+        file tmp = open("/tmplist", "w");
+        compact_ctx ctx = { &changes, &tmp, false };
+
+        // Lines of any format are parsed into the plain entries the journal records,
+        // then new entries are appended
+        if( exists("/blacklist.txt") )
+        {
+            file blacklist = open("/blacklist.txt", "r");
+            list_parser parser(compact_entry, &ctx);
+            char buffer[1024];
+            size_t size;
+            while( (size = blacklist.read(buffer, 1, sizeof(buffer))) > 0 )
+                parser.feed(buffer, size);
+            parser.finish();
+        }
+
+        for( std::map<std::string, bool>::iterator it = changes.begin(); it != changes.end(); it++ )
+        {
+            if( it->second && (fputs(it->first.c_str(), tmp.handle) == EOF || fputc('\n', tmp.handle) == EOF) )
+                ctx.failed = true;
+        }
+        written = !ctx.failed && fflush(tmp.handle) == 0;
+    }
+
+    if( !written )
+    {
+        unlink("/tmplist");
+        THROWE(ESP_FAIL, "Unable to write compacted blacklist");
+    }
+    if( exists("/blacklist.txt") )
+        unlink("/blacklist.txt");
+    rename("/tmplist", "/blacklist.txt");
+    unlink(JOURNAL_PATH);
+    journal_records = 0;
+}
+
+esp_err_t compact_blacklist()
+{
+    if( file_mutex == NULL )
         return ESP_FAIL;
+
+    xSemaphoreTake(file_mutex, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if( journal_records > 0 )
+    {
+        try{
+            int64_t start = esp_timer_get_time();
+            compact();
+            ESP_LOGI(TAG, "Compacted blacklist in %lld ms", (esp_timer_get_time()-start)/1000);
+        }catch(const Err& e){
+            err = ESP_FAIL;
+        }catch(const std::bad_alloc& e){
+            err = ESP_ERR_NO_MEM;
+        }
     }
+    xSemaphoreGive(file_mutex);
+    return err;
+}
 
-    if(found_url)
-        return ESP_OK;
-    else
-        return URL_ERR_NOT_FOUND;
-}
\ No newline at end of file
+// Compacts the journal once edits stop for a while, or once it grows too long
+static void compact_task(void* parameters)
+{
+    while(1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while( journal_records < MAX_JOURNAL_RECORDS && 
+               ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(COMPACT_DELAY_MS)) > 0 ) 
+        {}
+
+        compact_blacklist();
+    }
+}
@@ -5,6 +5,23 @@
 
 #define MAX_URL_LENGTH 255
 
+struct domain_key;                              // See domain_index.h
+
+// Every blocklist entry is tagged with the list it comes from,
+// policy groups pick the lists that apply to their clients
+#define USER_LIST               0x0001          // blacklist.txt and its allowlist entries
+#define SUBSCRIPTION_LIST(i)    (0x0002 << (i)) // i-th list of subscriptions.txt
+#define MAX_SUBSCRIPTION_LISTS  13
+#define IMAGE_LIST              0x8000          // Blocklist partition image
+#define ALL_LISTS               0xFFFF
+
+// Categories of subscribed lists, blocking of each category is switched at runtime
+#define CATEGORY_ADS            0x01
+#define CATEGORY_TRACKING       0x02
+#define CATEGORY_MALWARE        0x04
+#define CATEGORY_ADULT          0x08
+#define ALL_CATEGORIES          0x0F
+
 
 /**
   * @brief Add url to blacklist
@@ -28,6 +45,86 @@ esp_err_t add_to_blacklist(const char* hostname);
   */
 esp_err_t remove_from_blacklist(const char* hostname);
 
+/**
+  * @brief Add hostname to allowlist, stored in blacklist.txt as "@@hostname"
+  * 
+  * An allowlist entry wins over block entries for the same or a less specific name,
+  * "*.example.com" allows all subdomains
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - URL_ERR_INVALID_URL invalid hostname
+  *    - ESP_FAIL unable to access flash
+  */
+esp_err_t add_to_allowlist(const char* hostname);
+
+/**
+  * @brief Remove hostname from allowlist
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - URL_ERR_NOT_FOUND hostname not in allowlist
+  *    - ESP_FAIL unable to access flash
+  */
+esp_err_t remove_from_allowlist(const char* hostname);
+
+/**
+  * @brief Reads the next part of a list, returns bytes read, 0 at the end or < 0 on error
+  */
+typedef int (*list_reader)(char* buffer, size_t size, void* ctx);
+
+/**
+  * @brief Replace blacklist.txt with a list in any format, or add it to blacklist.txt
+  * 
+  * The list is parsed and saved as plain entries as it is read, then indexed once it
+  * is complete. DNS queries keep using the current lists until then, and edits only
+  * wait for the saved list to be moved into blacklist.txt, not for the upload
+  *
+  * @param read called until the whole list is read
+  * @param append add entries instead of replacing blacklist.txt and its journal
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_ERR_NO_MEM not enough memory for the new lists
+  *    - ESP_FAIL read error or unable to write flash, lists are unchanged
+  */
+esp_err_t import_blacklist(list_reader read, void* ctx, bool append);
+
+/**
+  * @brief Writes the next part of an exported list, returns false to stop the export
+  */
+typedef bool (*list_writer)(const char* data, size_t len, void* ctx);
+
+/**
+  * @brief Write every entry DNS queries are checked against as blacklist.txt lines
+  * 
+  * Covers blacklist.txt, subscribed lists and the blocklist image if one is loaded,
+  * each under a "#" comment. Entries are collected about 1 KB at a time and written
+  * with nothing locked, so queries and edits never wait for write. 
+  * The image follows one block at a time
+  *
+  * @param write called with parts of about 1 KB
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_ERR_NO_MEM
+  *    - ESP_ERR_INVALID_STATE lists were reloaded or blocklist image was replaced during the export
+  *    - ESP_FAIL write returned false
+  */
+esp_err_t export_blacklist(list_writer write, void* ctx);
+
+/**
+  * @brief Merge journaled edits into blacklist.txt
+  * 
+  * Edits are appended to a journal and compacted in the background,
+  * call this before reading blacklist.txt directly
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_FAIL unable to access flash
+  */
+esp_err_t compact_blacklist();
+
 /**
   * @brief Pull blacklist from flash and store in RAM
   *
@@ -52,11 +149,240 @@ bool valid_url(const char* url);
   * @brief Check to see if URL is in blacklist
   *
   * @param url url to be checked
+  * @param lists bitmask of the lists to check, see client_lists()
   *
   * @return
   *     - True In blacklist
   *     - False Not in blacklist
   */
-IRAM_ATTR bool in_blacklist(const char* domain);
+IRAM_ATTR bool in_blacklist(const char* domain, uint16_t lists = ALL_LISTS);
+
+/**
+  * @brief Same as in_blacklist(), for a name that is already normalized and hashed
+  */
+IRAM_ATTR bool in_blacklist(const domain_key& key, uint16_t lists = ALL_LISTS);
+
+/**
+  * @brief Find every list blocking URL, for results shared between clients
+  *
+  * @return bitmask of the lists blocking domain, 0 if not blocked
+  */
+IRAM_ATTR uint16_t blocking_lists(const char* domain);
+IRAM_ATTR uint16_t blocking_lists(const domain_key& key);
+
+/**
+  * @brief Called with a rule as blacklist.txt lines separated by ' ' and its hits
+  */
+typedef void (*rule_callback)(const char* rule, uint32_t hits, void* ctx);
+
+/**
+  * @brief Find the rules of blacklist.txt and subscriptions matched most often
+  * 
+  * Every domain entry and pattern counts the lookups it decided, including those
+  * answered from the lookup cache. Counts carry over edits and are reset when
+  * the lists are reloaded. Entries of the image aren't counted
+  *
+  * @param limit most rules to pass to fn, at most 1000
+  * @param fn called for each rule, most hits first
+  * @param rules set to the number of counted rules
+  * @param unused set to the number of rules without hits
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_ERR_NO_MEM
+  */
+esp_err_t top_rules(size_t limit, rule_callback fn, void* ctx, size_t* rules, size_t* unused);
+
+/**
+  * @brief Parse comma separated category names: ads, tracking, malware, adult
+  *
+  * @return CATEGORY_* flags, -1 if a name is unknown
+  */
+int parse_categories(const char* names);
+
+/**
+  * @brief Select the categories that block, from the next query on
+  * 
+  * Lists tagged with categories in subscriptions.txt only block while one of their
+  * categories is enabled, other lists always block. Lists aren't reloaded
+  *
+  * @param categories CATEGORY_* flags
+  */
+void set_enabled_categories(uint8_t categories);
+uint8_t enabled_categories();
+
+/**
+  * @brief Drop cached results of in_blacklist() and blocking_lists()
+  * 
+  * Lookups are cached until any list changes, called whenever lists are
+  * replaced or edited
+  */
+void invalidate_verdicts();
+
+/**
+  * @brief Load blocked IP ranges from ipblacklist.txt into RAM
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_FAIL unable to get info from flash
+  */
+esp_err_t initialize_ip_blacklist();
+
+/**
+  * @brief Replace blocked IP ranges, one CIDR range or address per line
+  *
+  * @param ranges newline separated list of ranges
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - URL_ERR_INVALID_URL a line is not a valid range
+  *    - ESP_FAIL unable to save to flash
+  */
+esp_err_t save_ip_blacklist(const char* ranges);
+
+/**
+  * @brief Check if an address falls into a blocked IP range
+  *
+  * @param addr address in network byte order
+  * @param len 4 for IPv4, 16 for IPv6
+  *
+  * @return
+  *     - True In a blocked range
+  *     - False Not blocked
+  */
+IRAM_ATTR bool ip_in_blacklist(const uint8_t* addr, size_t len);
+
+/**
+  * @brief Load client policy groups from groups.txt into RAM
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_FAIL unable to get info from flash
+  */
+esp_err_t initialize_policy_groups();
+
+/**
+  * @brief Replace client policy groups, one group per line
+  * 
+  * Each line is "name lists clients...", lists is a comma separated selection of
+  * user, sub1 to sub13 (in order of subscriptions.txt), image, all 
+  * or none, clients are CIDR ranges or addresses. The longest range containing 
+  * a client decides its group, clients outside every group use all lists
+  *
+  * @param groups newline separated list of groups
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - URL_ERR_INVALID_URL a line is not a valid group
+  *    - ESP_FAIL unable to save to flash
+  */
+esp_err_t save_policy_groups(const char* groups);
+
+/**
+  * @brief Lists that apply to a client, from its policy group
+  *
+  * @param addr address in network byte order
+  * @param len 4 for IPv4, 16 for IPv6
+  *
+  * @return bitmask of lists to pass to in_blacklist()
+  */
+IRAM_ATTR uint16_t client_lists(const uint8_t* addr, size_t len);
+
+/**
+  * @brief Map blocklist image from the blocklist partition
+  * 
+  * The image is queried in place, only a sparse block index is kept in RAM.
+  * Images are built by the list compiler in software/tools and validated by their checksum
+  *
+  * @return
+  *    - ESP_OK Success, also when there is no partition or image
+  *    - ESP_ERR_NO_MEM
+  */
+esp_err_t initialize_list_image();
+
+/**
+  * @brief Check if key's name is blocked by the blocklist image
+  */
+bool in_list_image(const domain_key& key);
+
+/**
+  * @brief Call fn with the name and MATCH_* flag of every entry in one block of the image
+  *
+  * @param checksum checksum of the image being read, 0 on the first call
+  *
+  * @return
+  *     - 1 Block read
+  *     - 0 No more blocks, or no image
+  *     - < 0 Image was replaced since checksum was set
+  */
+int read_list_image_block(size_t block, void (*fn)(const char* name, size_t len, uint8_t flags, void* ctx), 
+                          void* ctx, uint32_t* checksum);
+
+/**
+  * @brief Copy part of the blocklist image, to download it
+  *
+  * @param checksum checksum of the image being read, 0 on the first call
+  *
+  * @return bytes copied, 0 at the end or if there is no image, < 0 if image was replaced
+  */
+int read_list_image(size_t offset, void* buffer, size_t size, uint32_t* checksum);
+
+/**
+  * @brief Start replacing blocklist image, image is unavailable until end_list_image_update()
+  *
+  * @param size total size of new image
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_ERR_NOT_FOUND No blocklist partition
+  *    - ESP_ERR_INVALID_SIZE Image does not fit in partition
+  */
+esp_err_t begin_list_image_update(size_t size);
+
+/**
+  * @brief Write next part of new blocklist image
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_ERR_INVALID_SIZE More data than given to begin_list_image_update()
+  *    - Flash errors
+  */
+esp_err_t write_list_image(const void* data, size_t len);
+
+/**
+  * @brief Finish replacing blocklist image and map it
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_ERR_INVALID_ARG Image is invalid
+  *    - ESP_ERR_NO_MEM not enough memory for the block index of the image
+  */
+esp_err_t end_list_image_update();
+
+/**
+  * @brief Start task that downloads subscribed lists, refreshed every few hours
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - ESP_ERR_NO_MEM
+  */
+esp_err_t init_subscriptions();
+
+/**
+  * @brief Check all subscribed lists for changes now
+  */
+void refresh_subscriptions();
+
+/**
+  * @brief Replace subscribed list URLs, one http:// or https:// URL per line, up to MAX_SUBSCRIPTION_LISTS
+  * 
+  * A URL may be followed by the categories of its list, "https://example.com/ads.txt ads,tracking"
+  *
+  * @return
+  *    - ESP_OK Success
+  *    - URL_ERR_INVALID_URL invalid URL or too many subscriptions
+  *    - ESP_FAIL unable to access flash
+  */
+esp_err_t save_subscriptions(const char* urls);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,278 @@
+#include "parser.h"
+#include "domain_index.h"
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+
+static bool valid_entry(const char* entry)
+{
+    if( *entry == '\0' )
+        return false;
+
+    for( const char* c = entry; *c != '\0'; c++ )
+    {
+        if( !isalnum((unsigned char)*c) && *c != '.' && *c != '-' && *c != '_' && *c != '*' && *c != '?' )
+            return false;
+    }
+    return true;
+}
+
+// Dotted quad or anything with a ':' (IPv6), as used in the first column of hosts files
+static bool is_address(const char* token)
+{
+    if( strchr(token, ':') != NULL )
+    {
+        for( const char* c = token; *c != '\0'; c++ )
+        {
+            if( !isxdigit((unsigned char)*c) && *c != ':' && *c != '.' && *c != '%' )
+                return false;
+        }
+        return true;
+    }
+
+    int dots = 0;
+    for( const char* c = token; *c != '\0'; c++ )
+    {
+        if( *c == '.' )
+            dots++;
+        else if( !isdigit((unsigned char)*c) )
+            return false;
+    }
+    return dots == 3;
+}
+
+// Names hosts files map to themselves
+static bool is_local_name(const char* name)
+{
+    static const char* const names[] = {
+        "localhost", "localhost.localdomain", "local", "broadcasthost", 
+        "ip6-localhost", "ip6-loopback", "ip6-localnet", "ip6-mcastprefix", 
+        "ip6-allnodes", "ip6-allrouters", "ip6-allhosts", "0.0.0.0"
+    };
+    for( size_t i = 0; i < sizeof(names)/sizeof(names[0]); i++ )
+    {
+        if( strcasecmp(name, names[i]) == 0 )
+            return true;
+    }
+    return false;
+}
+
+list_parser::list_parser(entry_callback callback_, void* ctx_, bool dedupe_)
+: callback(callback_), ctx(ctx_), len(0), overflow(false), last_flags(0), dedupe(dedupe_), seen_count(0), 
+  entries(0), skipped(0)
+{
+    last[0] = '\0';
+    memset(counts, 0, sizeof(counts));
+}
+
+void list_parser::feed(const char* data, size_t size)
+{
+    for( size_t i = 0; i < size; i++ )
+    {
+        char c = data[i];
+        if( c == '\n' )
+        {
+            if( overflow )
+                skipped++;
+            else
+                parse_line();
+            len = 0;
+            overflow = false;
+        }
+        else if( len < MAX_LINE_LENGTH )
+        {
+            line[len++] = c;
+        }
+        else
+        {
+            overflow = true;
+        }
+    }
+}
+
+void list_parser::finish()
+{
+    if( len > 0 && !overflow )
+        parse_line();
+    len = 0;
+    overflow = false;
+}
+
+ListFormat list_parser::format() const
+{
+    ListFormat format = FORMAT_UNKNOWN;
+    for( int f = FORMAT_PLAIN; f <= FORMAT_ADBLOCK; f++ )
+    {
+        if( counts[f] > counts[format] )
+            format = (ListFormat)f;
+    }
+    return format;
+}
+
+bool list_parser::emit(char* entry, uint8_t flags)
+{
+    // "*.example.com" is example.com's subdomains, other wildcards stay patterns
+    if( entry[0] == '*' && entry[1] == '.' && strpbrk(entry + 2, "*?") == NULL )
+    {
+        entry += 2;
+        flags = (flags & ENTRY_EXCEPTION) | MATCH_SUBDOMAINS;
+    }
+
+    if( !valid_entry(entry) )
+        return false;
+
+    size_t n = normalize_domain(entry, entry);
+    if( n == 0 )
+        return false;
+
+    if( flags == last_flags && strcmp(entry, last) == 0 )
+        return true;
+    memcpy(last, entry, n + 1);
+    last_flags = flags;
+    if( dedupe && seen_before(entry, n, flags) )
+        return true;
+
+    entries++;
+    callback(entry, n, flags, ctx);
+    return true;
+}
+
+// Remember entry, true if it was emitted with the same flags before. Entries are told
+// apart by a 64 bit hash, two of them colliding in a list that fits in flash is unlikely
+bool list_parser::seen_before(const char* entry, size_t n, uint8_t flags)
+{
+    uint64_t hash = (0xcbf29ce484222325ULL ^ flags) * 0x100000001b3ULL;
+    for( size_t i = 0; i < n; i++ )
+        hash = (hash ^ (uint8_t)entry[i]) * 0x100000001b3ULL;
+    if( hash == 0 )
+        hash = 1;
+
+    // Open addressing, kept at most half full
+    if( (seen_count + 1) * 2 > seen.size() )
+    {
+        std::vector<uint64_t> old;
+        old.swap(seen);
+        seen.assign(old.empty() ? 1024 : old.size() * 2, 0);
+        size_t mask = seen.size() - 1;
+        for( size_t i = 0; i < old.size(); i++ )
+        {
+            if( old[i] == 0 )
+                continue;
+            size_t slot = (size_t)(old[i] ^ (old[i] >> 32)) & mask;
+            while( seen[slot] != 0 )
+                slot = (slot + 1) & mask;
+            seen[slot] = old[i];
+        }
+    }
+
+    size_t mask = seen.size() - 1;
+    size_t slot = (size_t)(hash ^ (hash >> 32)) & mask;
+    while( seen[slot] != 0 )
+    {
+        if( seen[slot] == hash )
+            return true;
+        slot = (slot + 1) & mask;
+    }
+    seen[slot] = hash;
+    seen_count++;
+    return false;
+}
+
+// ||example.com^ with optional "$important", "|" or "^" ends
+bool list_parser::parse_adblock(char* rule, bool exception)
+{
+    char* domain = rule + 2;
+    size_t n = strcspn(domain, "^$|/");
+    char end = domain[n];
+    domain[n] = '\0';
+
+    if( end == '/' )
+        return false;
+    if( end != '\0' )
+    {
+        const char* rest = domain + n + 1;
+        if( end == '^' && *rest == '|' )
+            rest++;
+        if( end == '$' || *rest == '$' )
+        {
+            const char* options = (end == '$') ? rest : rest + 1;
+            if( strcmp(options, "important") != 0 )
+                return false;
+        }
+        else if( *rest != '\0' )
+        {
+            return false;
+        }
+    }
+
+    return emit(domain, MATCH_EXACT | MATCH_SUBDOMAINS | (exception ? ENTRY_EXCEPTION : 0));
+}
+
+// 0.0.0.0 example.com [more names...]
+bool list_parser::parse_hosts(char* line)
+{
+    char* save;
+    strtok_r(line, " \t", &save);
+    bool any = false;
+    for( char* name = strtok_r(NULL, " \t", &save); name != NULL; name = strtok_r(NULL, " \t", &save) )
+    {
+        if( !is_local_name(name) && strpbrk(name, "*?") == NULL )
+            any |= emit(name, MATCH_EXACT);
+    }
+    return any;
+}
+
+void list_parser::parse_line()
+{
+    line[len] = '\0';
+    line[strcspn(line, "\r")] = '\0';
+
+    char* start = line;
+    while( isspace((unsigned char)*start) )
+        start++;
+
+    // Adblock comments, headers & cosmetic rules
+    if( *start == '!' || *start == '[' || strstr(start, "##") != NULL || strstr(start, "#@#") != NULL || strstr(start, "#?#") != NULL )
+        return;
+
+    start[strcspn(start, "#")] = '\0';
+    size_t n = strlen(start);
+    while( n > 0 && isspace((unsigned char)start[n-1]) )
+        n--;
+    start[n] = '\0';
+    if( n == 0 )
+        return;
+
+    bool exception = (strncmp(start, "@@", 2) == 0);
+    char* rule = exception ? start + 2 : start;
+
+    bool parsed;
+    ListFormat format;
+    if( strncmp(rule, "||", 2) == 0 )
+    {
+        format = FORMAT_ADBLOCK;
+        parsed = parse_adblock(rule, exception);
+    }
+    else if( !exception && strpbrk(rule, " \t") != NULL )
+    {
+        char first[64];
+        size_t first_len = strcspn(rule, " \t");
+        if( first_len >= sizeof(first) )
+            first_len = sizeof(first) - 1;
+        memcpy(first, rule, first_len);
+        first[first_len] = '\0';
+
+        format = FORMAT_HOSTS;
+        parsed = is_address(first) && parse_hosts(rule);
+    }
+    else
+    {
+        format = exception ? FORMAT_ADBLOCK : FORMAT_PLAIN;
+        parsed = emit(rule, MATCH_EXACT | (exception ? ENTRY_EXCEPTION : 0));
+    }
+
+    if( parsed )
+        counts[format]++;
+    else
+        skipped++;
+}
@@ -0,0 +1,77 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define MAX_LINE_LENGTH 512
+
+#define ENTRY_EXCEPTION 0x80            // Entry is an exception ("@@" rule), combined with MATCH_* flags
+
+typedef void (*entry_callback)(const char* entry, size_t len, uint8_t flags, void* ctx);
+
+enum ListFormat {
+    FORMAT_UNKNOWN,
+    FORMAT_PLAIN,                       // example.com, *.example.com, ads.*.net
+    FORMAT_HOSTS,                       // 0.0.0.0 example.com
+    FORMAT_ADBLOCK,                     // ||example.com^, @@||example.com^
+};
+
+/**
+  * @brief Incremental parser for blocklists arriving in chunks
+  * 
+  * Data can be split at any byte, only the current line is buffered.
+  * The format of each line is detected on its own, so mixed lists work.
+  * Entries are passed to the callback normalized, with the MATCH_* flags 
+  * they imply ("||example.com^" is the domain and all of its subdomains, 
+  * "*.example.com" only its subdomains). Repeated entries on consecutive 
+  * lines are dropped. Entries repeated anywhere else are dropped too when 
+  * deduplicating, which costs 16 bytes per entry at most, otherwise they 
+  * are left to the index.
+  * Lines that are too long or that can't be expressed as a domain entry 
+  * (adblock rules with paths or options, cosmetic rules) are skipped.
+  */
+class list_parser {
+        entry_callback callback;
+        void* ctx;
+        char line[MAX_LINE_LENGTH+1];
+        size_t len;
+        bool overflow;                  // Current line is too long, skip until newline
+        char last[MAX_LINE_LENGTH+1];   // Last entry emitted, for dropping repeats
+        uint8_t last_flags;
+        bool dedupe;
+        std::vector<uint64_t> seen;     // Hashes of emitted entries when deduplicating, 0 is free
+        size_t seen_count;
+        size_t entries;
+        size_t skipped;
+        size_t counts[FORMAT_ADBLOCK+1];
+
+        void parse_line();
+        bool parse_adblock(char* rule, bool exception);
+        bool parse_hosts(char* line);
+        bool emit(char* entry, uint8_t flags);
+        bool seen_before(const char* entry, size_t len, uint8_t flags);
+    public:
+        /**
+          * @param dedupe drop every repeated entry, not only repeats on consecutive lines
+          */
+        list_parser(entry_callback callback, void* ctx, bool dedupe = false);
+
+        void feed(const char* data, size_t size);
+
+        /**
+          * @brief Parse last line if it has no trailing newline
+          */
+        void finish();
+
+        /**
+          * @brief Format most lines were in
+          */
+        ListFormat format() const;
+
+        size_t entry_count() const { return entries; }
+        size_t skipped_count() const { return skipped; }
+};
+
+#endif
@@ -0,0 +1,232 @@
+#include "pattern.h"
+#include "domain_index.h"
+#include <string.h>
+
+#include <algorithm>
+
+#define ANY             0xFF
+#define NONE            0xFE
+#define DEAD            0               // DFA state with no live NFA states
+#define START           1               // DFA state with the first state of every pattern
+#define UNKNOWN         0xFFFFFFFF
+#define CACHE_SIZE      (16*1024)       // Bytes of DFA cache
+#define MIN_STATES      8
+
+
+pattern_set::pattern_set()
+: class_count(1), words(0), compiled(false), max_states(MIN_STATES)
+{
+    memset(classes, 0, sizeof(classes));
+}
+
+pattern_set::pattern_set(const pattern_set& other)
+: class_count(1), words(0), compiled(false), max_states(MIN_STATES)
+{
+    memset(classes, 0, sizeof(classes));
+    *this = other;
+}
+
+pattern_set& pattern_set::operator=(const pattern_set& other)
+{
+    if( this == &other )
+        return *this;
+
+    patterns = other.patterns;
+    pattern_lists = other.pattern_lists;
+    hits.resize(other.hits.size());
+    for( size_t i = 0; i < hits.size(); i++ )
+        hits[i] = read_hits(&other.hits[i]);
+    compiled = false;
+    return *this;
+}
+
+bool pattern_set::add(const char* pattern, uint16_t lists)
+{
+    std::vector<std::string>::iterator it = std::find(patterns.begin(), patterns.end(), pattern);
+    if( it != patterns.end() )
+    {
+        uint16_t& existing = pattern_lists[it - patterns.begin()];
+        if( (existing | lists) == existing )
+            return false;
+        existing |= lists;
+        compiled = false;
+        return true;
+    }
+    patterns.push_back(pattern);
+    pattern_lists.push_back(lists);
+    hits.push_back(0);
+    compiled = false;
+    return true;
+}
+
+bool pattern_set::remove(const char* pattern)
+{
+    std::vector<std::string>::iterator it = std::find(patterns.begin(), patterns.end(), pattern);
+    if( it == patterns.end() )
+        return false;
+    pattern_lists.erase(pattern_lists.begin() + (it - patterns.begin()));
+    hits.erase(hits.begin() + (it - patterns.begin()));
+    patterns.erase(it);
+    compiled = false;
+    return true;
+}
+
+void pattern_set::clear()
+{
+    std::vector<std::string>().swap(patterns);
+    std::vector<uint16_t>().swap(pattern_lists);
+    std::vector<uint32_t>().swap(hits);
+    std::vector<nfa_state>().swap(nfa);
+    std::vector<uint32_t>().swap(starts);
+    flush();
+    compiled = false;
+}
+
+void pattern_set::compile()
+{
+    memset(classes, 0, sizeof(classes));
+    class_count = 1;
+    nfa.clear();
+    starts.clear();
+
+    for( uint32_t p = 0; p < patterns.size(); p++ )
+    {
+        starts.push_back(nfa.size());
+        bool loop = false;
+        for( size_t i = 0; i < patterns[p].size(); i++ )
+        {
+            uint8_t c = patterns[p][i];
+            if( c == '*' )
+            {
+                loop = true;
+                continue;
+            }
+
+            if( c != '?' && classes[c] == 0 )
+                classes[c] = class_count++;
+
+            nfa_state s = { (uint8_t)(c == '?' ? ANY : classes[c]), loop, false, p };
+            nfa.push_back(s);
+            loop = false;
+        }
+        nfa_state end = { NONE, loop, true, p };
+        nfa.push_back(end);
+    }
+    words = (nfa.size() + 31) / 32;
+
+    // Size cache for the number of NFA states and character classes
+    size_t state_bytes = (words + class_count + 1)*sizeof(uint32_t);
+    max_states = std::max((size_t)MIN_STATES, (size_t)CACHE_SIZE / state_bytes);
+    flush();
+    compiled = true;
+}
+
+void pattern_set::flush()
+{
+    sets.clear();
+    accepts.clear();
+    accept_lists.clear();
+    transitions.clear();
+
+    if( nfa.empty() )
+        return;
+
+    std::vector<uint32_t> set(words, 0);
+    add_state(set.data());
+    for( size_t i = 0; i < starts.size(); i++ )
+        set[starts[i]/32] |= 1UL << (starts[i]%32);
+    add_state(set.data());
+}
+
+uint32_t pattern_set::add_state(const uint32_t* set)
+{
+    // Small linear search, the cache is bounded
+    size_t count = accepts.size();
+    for( size_t i = 0; i < count; i++ )
+    {
+        if( memcmp(&sets[i*words], set, words*sizeof(uint32_t)) == 0 )
+            return i;
+    }
+
+    uint32_t accept = NO_MATCH;
+    uint16_t lists = 0;
+    for( size_t w = 0; w < words; w++ )
+    {
+        for( uint32_t bits = set[w]; bits; bits &= bits - 1 )
+        {
+            const nfa_state& s = nfa[w*32 + __builtin_ctz(bits)];
+            if( s.accept )
+            {
+                accept = std::min(accept, s.pattern);
+                lists |= pattern_lists[s.pattern];
+            }
+        }
+    }
+
+    sets.insert(sets.end(), set, set + words);
+    accepts.push_back(accept);
+    accept_lists.push_back(lists);
+    transitions.resize(transitions.size() + class_count, UNKNOWN);
+    return count;
+}
+
+uint32_t pattern_set::step(uint32_t state, uint8_t cls)
+{
+    uint32_t next = transitions[state*class_count + cls];
+    if( next != UNKNOWN )
+        return next;
+
+    std::vector<uint32_t> current(sets.begin() + state*words, sets.begin() + (state+1)*words);
+    std::vector<uint32_t> set(words, 0);
+    for( size_t w = 0; w < words; w++ )
+    {
+        for( uint32_t bits = current[w]; bits; bits &= bits - 1 )
+        {
+            size_t i = w*32 + __builtin_ctz(bits);
+            const nfa_state& s = nfa[i];
+            if( s.loop )
+                set[i/32] |= 1UL << (i%32);
+            if( s.token == ANY || (s.token == cls && cls != 0) )
+                set[(i+1)/32] |= 1UL << ((i+1)%32);
+        }
+    }
+
+    if( accepts.size() >= max_states )
+    {
+        flush();
+        return add_state(set.data());
+    }
+
+    next = add_state(set.data());
+    transitions[state*class_count + cls] = next;
+    return next;
+}
+
+uint32_t pattern_set::match(const char* name, size_t len, uint16_t* lists)
+{
+    if( lists != NULL )
+        *lists = 0;
+    if( patterns.empty() )
+        return NO_MATCH;
+    if( !compiled )
+        compile();
+
+    uint32_t state = START;
+    for( size_t i = 0; i < len && state != DEAD; i++ )
+        state = step(state, classes[(uint8_t)name[i]]);
+
+    if( lists != NULL )
+        *lists = accept_lists[state];
+    return accepts[state];
+}
+
+size_t pattern_set::memory() const
+{
+    size_t bytes = nfa.capacity()*sizeof(nfa_state) + starts.capacity()*sizeof(uint32_t) +
+                   sets.capacity()*sizeof(uint32_t) + accepts.capacity()*sizeof(uint32_t) + 
+                   accept_lists.capacity()*sizeof(uint16_t) + pattern_lists.capacity()*sizeof(uint16_t) + 
+                   hits.capacity()*sizeof(uint32_t) + transitions.capacity()*sizeof(uint32_t);
+    for( size_t i = 0; i < patterns.size(); i++ )
+        bytes += patterns[i].capacity();
+    return bytes;
+}
@@ -0,0 +1,94 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "domain_index.h"
+#include <string>
+#include <vector>
+
+/**
+  * @brief Set of '*'/'?' patterns matched together by one lazily built DFA
+  * 
+  * All patterns are compiled into a single NFA, one state per literal or '?',
+  * where '*' is a self loop. DFA states (sets of NFA states) and their 
+  * transitions are built on demand while matching and cached, so a name is
+  * matched in one pass regardless of the number of patterns. The cache is
+  * bounded, when full it is flushed and rebuilt from the current state.
+  * Patterns are matched against the whole name, like the previous wildcmp().
+  */
+class pattern_set {
+        struct nfa_state {
+            uint8_t token;              // Character class to advance on, ANY or NONE
+            bool loop;                  // Preceded by '*', stays on any character
+            bool accept;                // End of a pattern
+            uint32_t pattern;
+        };
+        std::vector<std::string> patterns;
+        std::vector<uint16_t> pattern_lists;  // Lists each pattern comes from
+        mutable std::vector<uint32_t> hits;   // Matches of each pattern
+        std::vector<nfa_state> nfa;
+        std::vector<uint32_t> starts;
+        uint8_t classes[256];           // Character -> class, 0 for characters no pattern uses
+        size_t class_count;
+        size_t words;                   // 32 bit words per NFA state set
+        bool compiled;
+
+        // Lazy DFA
+        std::vector<uint32_t> sets;     // State sets, words per state
+        std::vector<uint32_t> accepts;  // Lowest matching pattern per state, or NO_MATCH
+        std::vector<uint16_t> accept_lists; // Lists of all matching patterns per state
+        std::vector<uint32_t> transitions;
+        size_t max_states;
+
+        void compile();
+        void flush();
+        uint32_t add_state(const uint32_t* set);
+        uint32_t step(uint32_t state, uint8_t cls);
+    public:
+        pattern_set();
+
+        /**
+          * @brief Copy patterns and their hit counts, the copy builds its own DFA
+          *
+          * Only what match() doesn't change is read, so a set can be copied
+          * while it is being matched
+          */
+        pattern_set(const pattern_set& other);
+        pattern_set& operator=(const pattern_set& other);
+
+        /**
+          * @param lists bitmask of the lists the pattern comes from, combined with
+          *              those of the same pattern already in set
+          *
+          * @return false if pattern is already in set for these lists
+          */
+        bool add(const char* pattern, uint16_t lists = ALL_LISTS);
+        bool remove(const char* pattern);
+        void clear();
+        size_t size() const { return patterns.size(); }
+        const std::string& operator[](size_t i) const { return patterns[i]; }
+
+        /**
+          * @brief Match normalized name against all patterns
+          *
+          * @param lists set to the lists of every matching pattern
+          *
+          * @return index of the first matching pattern, NO_MATCH if none matches
+          */
+        uint32_t match(const char* name, size_t len, uint16_t* lists = NULL);
+
+        /**
+          * @brief Count a hit of the pattern match() returned
+          */
+        void count_hit(uint32_t i) const
+        {
+            if( i < hits.size() )
+                ::count_hit(&hits[i]);
+        }
+        uint32_t hit_count(size_t i) const { return read_hits(&hits[i]); }
+
+        size_t memory() const;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "prefix_tree.h"
+
+#define NONE 0xFFFFFFFF
+
+
+// Bit operations on keys, bit 0 is the most significant bit
+
+static inline int key_bits(uint32_t) { return 32; }
+static inline int key_bits(ip6_key) { return 128; }
+
+static inline int bit(uint32_t key, int i)
+{
+    return (key >> (31 - i)) & 1;
+}
+
+static inline int bit(ip6_key key, int i)
+{
+    return i < 64 ? (key.hi >> (63 - i)) & 1 : (key.lo >> (127 - i)) & 1;
+}
+
+static inline uint32_t mask(uint32_t key, int len)
+{
+    return len == 0 ? 0 : key & (0xFFFFFFFFUL << (32 - len));
+}
+
+static inline ip6_key mask(ip6_key key, int len)
+{
+    ip6_key masked;
+    masked.hi = len == 0 ? 0 : (len >= 64 ? key.hi : key.hi & (~0ULL << (64 - len)));
+    masked.lo = len <= 64 ? 0 : (len == 128 ? key.lo : key.lo & (~0ULL << (128 - len)));
+    return masked;
+}
+
+static inline bool equal(uint32_t a, uint32_t b)
+{
+    return a == b;
+}
+
+static inline bool equal(ip6_key a, ip6_key b)
+{
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+static inline int common_prefix(uint32_t a, uint32_t b)
+{
+    uint32_t diff = a ^ b;
+    return diff == 0 ? 32 : __builtin_clz(diff);
+}
+
+static inline int common_prefix(ip6_key a, ip6_key b)
+{
+    uint64_t diff = a.hi ^ b.hi;
+    if( diff != 0 )
+        return __builtin_clzll(diff);
+
+    diff = a.lo ^ b.lo;
+    return diff == 0 ? 128 : 64 + __builtin_clzll(diff);
+}
+
+
+template<typename Key>
+prefix_tree<Key>::prefix_tree()
+: root(NONE) {}
+
+template<typename Key>
+uint32_t prefix_tree<Key>::new_node(Key prefix, uint8_t len, uint16_t value)
+{
+    node n;
+    n.prefix = mask(prefix, len);
+    n.len = len;
+    n.value = value;
+    n.child[0] = NONE;
+    n.child[1] = NONE;
+    nodes.push_back(n);
+    return nodes.size() - 1;
+}
+
+template<typename Key>
+void prefix_tree<Key>::link(uint32_t parent, int side, uint32_t index)
+{
+    if( parent == NONE )
+        root = index;
+    else
+        nodes[parent].child[side] = index;
+}
+
+template<typename Key>
+void prefix_tree<Key>::insert(Key key, uint8_t len, uint16_t value)
+{
+    if( len > key_bits(key) )
+        len = key_bits(key);
+    key = mask(key, len);
+
+    uint32_t parent = NONE;
+    int side = 0;
+    uint32_t index = root;
+    while( index != NONE )
+    {
+        node n = nodes[index];
+        int cpl = common_prefix(key, n.prefix);
+        if( cpl > len ) cpl = len;
+        if( cpl > n.len ) cpl = n.len;
+
+        if( cpl == n.len )
+        {
+            if( len == n.len ) // prefix already in tree
+            {
+                nodes[index].value = value;
+                return;
+            }
+            parent = index;
+            side = bit(key, n.len);
+            index = n.child[side];
+            continue;
+        }
+
+        // New prefix diverges from (or ends inside) this node's prefix, split it
+        uint32_t split = new_node(key, cpl, cpl == len ? value : NO_VALUE);
+        nodes[split].child[bit(n.prefix, cpl)] = index;
+        if( cpl != len )
+        {
+            uint32_t leaf = new_node(key, len, value);
+            nodes[split].child[bit(key, cpl)] = leaf;
+        }
+        link(parent, side, split);
+        return;
+    }
+
+    link(parent, side, new_node(key, len, value));
+}
+
+template<typename Key>
+bool prefix_tree<Key>::lookup(Key key, uint16_t* value) const
+{
+    bool found = false;
+    uint32_t index = root;
+    while( index != NONE )
+    {
+        const node& n = nodes[index];
+        if( !equal(mask(key, n.len), n.prefix) )
+            break;
+
+        if( n.value != NO_VALUE )
+        {
+            *value = n.value;
+            found = true;
+        }
+
+        if( n.len == key_bits(key) )
+            break;
+        index = n.child[bit(key, n.len)];
+    }
+    return found;
+}
+
+template<typename Key>
+void prefix_tree<Key>::clear()
+{
+    nodes.clear();
+    nodes.shrink_to_fit();
+    root = NONE;
+}
+
+template class prefix_tree<uint32_t>;
+template class prefix_tree<ip6_key>;
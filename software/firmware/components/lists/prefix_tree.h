@@ -0,0 +1,68 @@
+#ifndef PREFIX_TREE_H
+#define PREFIX_TREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+  * @brief 128 bit key for IPv6 prefixes, stored in host order
+  */
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} ip6_key;
+
+/**
+  * @brief Path compressed binary radix tree for longest-prefix-match lookups
+  * 
+  * Keys are IP addresses in host byte order (uint32_t for IPv4, ip6_key for IPv6).
+  * Nodes are kept in one flat array and linked by index, each node holds the 
+  * prefix it represents, so a lookup walks at most one node per distinct
+  * branching point instead of one per bit.
+  * 
+  */
+template<typename Key>
+class prefix_tree {
+        struct node {
+            Key prefix;
+            uint8_t len;
+            uint16_t value;
+            uint32_t child[2];
+        };
+        std::vector<node> nodes;
+        uint32_t root;
+
+        uint32_t new_node(Key prefix, uint8_t len, uint16_t value);
+        void link(uint32_t parent, int side, uint32_t index);
+    public:
+        static const uint16_t NO_VALUE = 0xFFFF;
+
+        prefix_tree();
+
+        /**
+          * @brief Add prefix to tree, replaces the value if the prefix already exists
+          *
+          * @param key address, bits past len are ignored
+          * @param len prefix length in bits
+          * @param value value returned by lookups matching this prefix, must not be NO_VALUE
+          */
+        void insert(Key key, uint8_t len, uint16_t value);
+
+        /**
+          * @brief Find the longest prefix containing key
+          *
+          * @param key address to look up
+          * @param value set to the value of the longest matching prefix
+          *
+          * @return
+          *     - true A prefix matched
+          *     - false No prefix contains key
+          */
+        bool lookup(Key key, uint16_t* value) const;
+
+        size_t size() const { return nodes.size(); }
+        void clear();
+};
+
+#endif
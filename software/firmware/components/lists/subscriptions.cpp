@@ -0,0 +1,385 @@
+#include "lists.h"
+#include "subscriptions.h"
+#include "parser.h"
+#include "domain_index.h"
+#include "error.h"
+#include "filesystem.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include <string.h>
+#include <strings.h>
+
+#include <string>
+#include <vector>
+
+#ifdef CONFIG_LOCAL_LOG_LEVEL
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#include "esp_log.h"
+static const char *TAG = "SUBSCRIPTION";
+
+#define SUBSCRIPTIONS_PATH  "/subscriptions.txt"
+#define MAX_REDIRECTS       5
+#define BUFFSIZE            1024                    // Size of download buffer
+#define REFRESH_INTERVAL_S  (6*3600)                // Interval for refreshing lists
+
+static TaskHandle_t subscription_task_handle = NULL;
+
+
+// Downloaded lists are cached as /sub_<hash of url>.txt, with the ETag 
+// & Last-Modified validators of the download in /sub_<hash of url>.meta
+static std::string cache_path(const std::string& url, const char* ext)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/sub_%08x.%s", label_hash(url.c_str(), url.size()), ext);
+    return path;
+}
+
+// Lines of subscriptions.txt are "url [categories]", categories are set to the 
+// CATEGORY_* flags of each url
+static std::vector<std::string> read_subscriptions(std::vector<uint8_t>* categories = NULL)
+{
+    std::vector<std::string> urls;
+    using namespace fs;
+    if( !exists(SUBSCRIPTIONS_PATH) )
+        return urls;
+
+    file list = open(SUBSCRIPTIONS_PATH, "r");
+    char line[256];
+    while( fgets(line, sizeof(line), list.handle) != NULL )
+    {
+        line[strcspn(line, "#\r\n")] = 0;
+        char* save;
+        char* url = strtok_r(line, " \t", &save);
+        if( url == NULL )
+            continue;
+        if( urls.size() == MAX_SUBSCRIPTION_LISTS )
+        {
+            ESP_LOGW(TAG, "Only the first %d subscriptions are used", MAX_SUBSCRIPTION_LISTS);
+            break;
+        }
+        urls.push_back(url);
+
+        char* names = strtok_r(NULL, " \t", &save);
+        int flags = (names != NULL) ? parse_categories(names) : 0;
+        if( flags < 0 )
+        {
+            ESP_LOGW(TAG, "Unknown category in %s", names);
+            flags = 0;
+        }
+        if( categories != NULL )
+            categories->push_back(flags);
+    }
+    return urls;
+}
+
+static bool valid_subscription(const char* url)
+{
+    return strncmp(url, "http://", 7) == 0 || strncmp(url, "https://", 8) == 0;
+}
+
+class list_download {
+        esp_http_client_handle_t client_handle;
+        static esp_err_t event_handler(esp_http_client_event_t* evt);
+    public:
+        std::string etag;
+        std::string last_modified;
+        int content_length;
+
+        list_download(const std::string& url, const std::string& if_none_match, const std::string& if_modified_since);
+        ~list_download();
+        int status();
+        int read(char* buf, int bufsize);
+};
+
+list_download::list_download(const std::string& url, const std::string& if_none_match, const std::string& if_modified_since)
+{
+    esp_http_client_config_t config = {};
+    config.url = url.c_str();
+    config.timeout_ms = 5000;
+    config.event_handler = event_handler;
+    config.user_data = this;
+    config.crt_bundle_attach = esp_crt_bundle_attach;     // https lists are checked against common CAs
+
+    client_handle = esp_http_client_init(&config);
+    if( client_handle == NULL ) {
+        THROWE(URL_ERR_DOWNLOAD, "Failed to initialise connection to %s", url.c_str())
+    }
+
+    // Server answers 304 if the list hasn't changed since the last download
+    if( !if_none_match.empty() )
+        esp_http_client_set_header(client_handle, "If-None-Match", if_none_match.c_str());
+    if( !if_modified_since.empty() )
+        esp_http_client_set_header(client_handle, "If-Modified-Since", if_modified_since.c_str());
+
+    // Lists are often served through redirects, which reading a stream doesn't follow itself
+    for( int redirects = 0; ; redirects++ )
+    {
+        etag.clear();
+        last_modified.clear();
+        if( esp_http_client_open(client_handle, 0) != ESP_OK ) {
+            esp_http_client_cleanup(client_handle);
+            THROWE(URL_ERR_DOWNLOAD, "Failed to open connection to %s", url.c_str())
+        }
+        // -1 when the server doesn't send Content-Length (chunked transfer)
+        content_length = esp_http_client_fetch_headers(client_handle);
+
+        int code = esp_http_client_get_status_code(client_handle);
+        if( code != 301 && code != 302 && code != 303 && code != 307 && code != 308 )
+            break;
+        esp_http_client_close(client_handle);
+        if( redirects == MAX_REDIRECTS || esp_http_client_set_redirection(client_handle) != ESP_OK ) {
+            esp_http_client_cleanup(client_handle);
+            THROWE(URL_ERR_DOWNLOAD, "Unable to follow redirect of %s", url.c_str())
+        }
+    }
+}
+
+list_download::~list_download()
+{
+    esp_http_client_close(client_handle);
+    esp_http_client_cleanup(client_handle);
+}
+
+esp_err_t list_download::event_handler(esp_http_client_event_t* evt)
+{
+    if( evt->event_id == HTTP_EVENT_ON_HEADER )
+    {
+        list_download* download = (list_download*)evt->user_data;
+        if( strcasecmp(evt->header_key, "ETag") == 0 )
+            download->etag = evt->header_value;
+        else if( strcasecmp(evt->header_key, "Last-Modified") == 0 )
+            download->last_modified = evt->header_value;
+    }
+    return ESP_OK;
+}
+
+int list_download::status()
+{
+    return esp_http_client_get_status_code(client_handle);
+}
+
+int list_download::read(char* buf, int bufsize)
+{
+    int data_read = esp_http_client_read(client_handle, buf, bufsize);
+    if( data_read < 0 )
+    {
+        THROWE(URL_ERR_DOWNLOAD, "Error reading list");
+    }
+    return data_read;
+}
+
+// Cached copies are plain lists, "*.example.com" for subdomains and "@@" for exceptions
+static void write_entry(const char* entry, size_t len, uint8_t flags, void* ctx)
+{
+    fs::file* f = (fs::file*)ctx;
+    const char* prefix = (flags & ENTRY_EXCEPTION) ? "@@" : "";
+    if( flags & MATCH_EXACT )
+        fprintf(f->handle, "%s%s\n", prefix, entry);
+    if( flags & MATCH_SUBDOMAINS )
+        fprintf(f->handle, "%s*.%s\n", prefix, entry);
+}
+
+// Download list if it changed, returns true if the cached copy was replaced
+static bool refresh(const std::string& url)
+{
+    using namespace fs;
+    std::string list_path = cache_path(url, "txt");
+    std::string meta_path = cache_path(url, "meta");
+
+    std::string etag, last_modified;
+    if( exists(list_path) && exists(meta_path) )
+    {
+        file meta = open(meta_path, "r");
+        char line[128];
+        if( fgets(line, sizeof(line), meta.handle) != NULL )
+        {
+            line[strcspn(line, "\r\n")] = 0;
+            etag = line;
+        }
+        if( fgets(line, sizeof(line), meta.handle) != NULL )
+        {
+            line[strcspn(line, "\r\n")] = 0;
+            last_modified = line;
+        }
+    }
+
+    ESP_LOGI(TAG, "Refreshing %s", url.c_str());
+    list_download download(url, etag, last_modified);
+    int status = download.status();
+    if( status == 304 )
+    {
+        ESP_LOGI(TAG, "Not modified");
+        return false;
+    }
+    if( status != 200 )
+    {
+        THROWE(URL_ERR_DOWNLOAD, "Server returned %d", status);
+    }
+
+    // Parse while downloading, only normalized entries are written to flash
+    std::string tmp_path = cache_path(url, "tmp");
+    size_t entries;
+    try{
+        {
+            file tmp = open(tmp_path, "w");
+            list_parser parser(write_entry, &tmp);
+            char buffer[BUFFSIZE];
+            int data_read;
+            int total = 0;
+            while( (data_read = download.read(buffer, sizeof(buffer))) > 0 )
+            {
+                parser.feed(buffer, data_read);
+                total += data_read;
+            }
+            // A connection that ends early must not replace the cached copy
+            if( download.content_length > 0 && total != download.content_length )
+            {
+                THROWE(URL_ERR_DOWNLOAD, "Received %d of %d bytes", total, download.content_length);
+            }
+            parser.finish();
+            if( fflush(tmp.handle) != 0 || ferror(tmp.handle) )
+            {
+                THROWE(URL_ERR_DOWNLOAD, "Failed to write %s", tmp_path.c_str());
+            }
+            entries = parser.entry_count();
+            ESP_LOGI(TAG, "Format %d, %d lines skipped", parser.format(), parser.skipped_count());
+        }
+
+        if( exists(list_path) )
+            unlink(list_path);
+        rename(tmp_path, list_path);
+    }catch(...){
+        if( exists(tmp_path) )
+            unlink(tmp_path);
+        throw;
+    }
+
+    file meta = open(meta_path, "w");
+    fprintf(meta.handle, "%s\n%s\n", download.etag.c_str(), download.last_modified.c_str());
+    ESP_LOGI(TAG, "Downloaded %d entries", entries);
+    return true;
+}
+
+std::vector<subscribed_list> subscription_files()
+{
+    std::vector<subscribed_list> files;
+    try{
+        std::vector<uint8_t> categories;
+        std::vector<std::string> urls = read_subscriptions(&categories);
+        for( size_t i = 0; i < urls.size(); i++ )
+        {
+            std::string path = cache_path(urls[i], "txt");
+            subscribed_list list = { fs::exists(path) ? path : std::string(), categories[i] };
+            files.push_back(list);
+        }
+    }catch(const Err& e){
+        ESP_LOGE(TAG, "%s", e.what());
+    }
+    return files;
+}
+
+static void subscription_task(void* parameters)
+{
+    while(1)
+    {
+        xTaskNotifyWait(0, 0, NULL, portMAX_DELAY);
+
+        bool changed = false;
+        try{
+            std::vector<std::string> urls = read_subscriptions();
+            for( size_t i = 0; i < urls.size(); i++ )
+            {
+                try{
+                    changed |= refresh(urls[i]);
+                }catch(const Err& e){
+                    ESP_LOGE(TAG, "%s: %s", urls[i].c_str(), e.what());
+                }
+            }
+        }catch(const Err& e){
+            ESP_LOGE(TAG, "%s", e.what());
+        }
+
+        if( changed )
+            initialize_blocklists();
+    }
+}
+
+void refresh_subscriptions()
+{
+    if( subscription_task_handle != NULL )
+        xTaskNotify(subscription_task_handle, 0, eNoAction);
+}
+
+static void refreshCallback(TimerHandle_t xTimer)
+{
+    refresh_subscriptions();
+}
+
+esp_err_t init_subscriptions()
+{
+    if( xTaskCreatePinnedToCore(&subscription_task, "subscription_task", 8192, NULL, 1, &subscription_task_handle, tskNO_AFFINITY) != pdPASS )
+        return ESP_ERR_NO_MEM;
+
+    xTimerHandle refreshTimer = xTimerCreate("Refresh lists", pdMS_TO_TICKS(1000*REFRESH_INTERVAL_S), pdTRUE, (void*)0, refreshCallback);
+    xTimerStart(refreshTimer, 0);
+    return ESP_OK;
+}
+
+esp_err_t save_subscriptions(const char* urls)
+{
+    std::vector<std::string> old_urls;
+    std::string list(urls);
+    std::string saved;
+    size_t count = 0;
+    char* save;
+    for( char* line = strtok_r(&list[0], "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save) )
+    {
+        if( line[0] == '\0' || line[0] == '#' )
+            continue;
+
+        // URL, optionally followed by its categories
+        std::string entry(line);
+        char* entry_save;
+        char* url = strtok_r(&entry[0], " \t", &entry_save);
+        char* names = strtok_r(NULL, " \t", &entry_save);
+        if( url == NULL || !valid_subscription(url) || ++count > MAX_SUBSCRIPTION_LISTS )
+            return URL_ERR_INVALID_URL;
+        if( names != NULL && parse_categories(names) < 0 )
+            return URL_ERR_INVALID_URL;
+        saved += line;
+        saved += '\n';
+    }
+
+    try{
+        using namespace fs;
+        old_urls = read_subscriptions();
+        {
+            file f = open(SUBSCRIPTIONS_PATH, "w");
+            f.write(saved.data(), 1, saved.size());
+        }
+
+        // Drop cached lists that are no longer subscribed
+        std::vector<std::string> new_urls = read_subscriptions();
+        for( size_t i = 0; i < old_urls.size(); i++ )
+        {
+            bool kept = false;
+            for( size_t j = 0; j < new_urls.size(); j++ )
+                kept |= (old_urls[i] == new_urls[j]);
+
+            if( !kept && exists(cache_path(old_urls[i], "txt")) )
+                unlink(cache_path(old_urls[i], "txt"));
+            if( !kept && exists(cache_path(old_urls[i], "meta")) )
+                unlink(cache_path(old_urls[i], "meta"));
+        }
+    }catch(const Err& e){
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = initialize_blocklists();
+    refresh_subscriptions();
+    return err;
+}
@@ -0,0 +1,20 @@
+#ifndef SUBSCRIPTIONS_H
+#define SUBSCRIPTIONS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct subscribed_list {
+    std::string path;               // Downloaded copy, one normalized entry per line
+    uint8_t categories;             // CATEGORY_* flags from subscriptions.txt
+};
+
+/**
+  * @brief Downloaded copies of all subscribed lists and their categories
+  * 
+  * In the order of subscriptions.txt, path is empty for lists that were not downloaded yet
+  */
+std::vector<subscribed_list> subscription_files();
+
+#endif
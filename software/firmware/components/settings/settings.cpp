@@ -43,11 +43,51 @@ static const char* get_key(Key s)
             return "blocking";
         case UPDATE_AVAILABLE:
             return "update_available";
+        case BLOCK_MODE:
+            return "block_mode";
+        case BLOCK_IP:
+            return "block_ip";
+        case BLOCK_IP6:
+            return "block_ip6";
+        case BLOCK_TTL:
+            return "block_ttl";
+        case CATEGORIES:
+            return "categories";
         default:
             return "";
     }
 }
 
+// settings.json from an older firmware version may be missing newer keys,
+// copy them over from the defaults embedded in the app binary
+static bool add_missing_keys()
+{
+    extern const char start_defaults[] asm("_binary_defaultsettings_json_start");
+    extern const char end_defaults[]   asm("_binary_defaultsettings_json_end");
+    std::string defaults_str(start_defaults, end_defaults - start_defaults);
+
+    cJSON* defaults = cJSON_Parse(defaults_str.c_str());
+    if( defaults == NULL )
+    {
+        THROWE(SETTING_ERR_PARSE, "Unable to parse defaultsettings.json (%s)", cJSON_GetErrorPtr());
+    }
+
+    bool added = false;
+    cJSON* item;
+    cJSON_ArrayForEach(item, defaults)
+    {
+        if( !cJSON_HasObjectItem(settings, item->string) )
+        {
+            ESP_LOGW(TAG, "Adding missing setting %s", item->string);
+            cJSON_AddItemToObject(settings, item->string, cJSON_Duplicate(item, true));
+            added = true;
+        }
+    }
+    cJSON_Delete(defaults);
+
+    return added;
+}
+
 void setting::load_settings()
 {
     using namespace fs;
@@ -73,6 +113,11 @@ void setting::load_settings()
     {
         THROWE(SETTING_ERR_PARSE, "Unable to parse settings.json (%s)", cJSON_GetErrorPtr());
     }
+
+    if( add_missing_keys() )
+    {
+        save_settings();
+    }
 }
 
 void setting::save_settings()
@@ -127,6 +172,22 @@ bool setting::read_bool(Key key)
     }
 }
 
+int setting::read_int(Key key)
+{
+    cJSON* object = cJSON_GetObjectItem(settings, get_key(key));
+    if( !object )
+    {
+        THROWE(SETTING_ERR_INVALID_KEY, "Invalid key %s", get_key(key));
+    }
+
+    if( !cJSON_IsNumber(object) )
+    {
+        THROWE(SETTING_ERR_WRONG_TYPE, "%s is not a number", get_key(key));
+    }
+
+    return object->valueint;
+}
+
 void setting::write(Key key, const char* value)
 {
     ESP_LOGI(TAG, "Writing %s to %s", value, get_key(key) );
@@ -171,5 +232,20 @@ void setting::write(Key key, bool value)
         value ? set_bit(BLOCKING_BIT):clear_bit(BLOCKING_BIT);
     }
 
+    save_settings();
+}
+
+void setting::write(Key key, int value)
+{
+    ESP_LOGI(TAG, "Writing %d to %s", value, get_key(key) );
+
+    cJSON* object = cJSON_GetObjectItem(settings, get_key(key));
+    if( !cJSON_IsNumber(object) )
+    {
+        THROWE(SETTING_ERR_WRONG_TYPE, "%s is not a number", get_key(key));
+    }
+
+    cJSON_SetNumberValue(object, value);
+
     save_settings();
 }
\ No newline at end of file
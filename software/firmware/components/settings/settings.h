@@ -17,15 +17,22 @@ namespace setting
         DNS_SRV,
         VERSION,
         BLOCK,
-        UPDATE_AVAILABLE
+        UPDATE_AVAILABLE,
+        BLOCK_MODE,
+        BLOCK_IP,
+        BLOCK_IP6,
+        BLOCK_TTL,
+        CATEGORIES
     }; 
 
     void load_settings();
     void save_settings();
     std::string read_str(Key key);
     bool read_bool(Key key);
+    int read_int(Key key);
     void write(Key key, const char* value);
     void write(Key key, bool value);
+    void write(Key key, int value);
 }
 
 
@@ -10,6 +10,7 @@
 #include "dns/server.h"
 #include "dns/dns.h"
 #include "debug.h"
+#include "lists.h"
 
 #include "nvs_flash.h"
 
@@ -28,6 +29,10 @@ static const char *TAG = "BOOT";
 // Simple macro that will rollback to previous version if any of the initialization steps fail
 #define CHECK(x) if( x != ESP_OK ) rollback();
 
+// Lists are data, a bad or oversized list must not roll back working firmware. 
+// Boot continues with whatever was loaded, empty lists at worst
+#define LOAD(x) { esp_err_t err = x; if( err != ESP_OK ) ESP_LOGE(TAG, #x " failed: %s", esp_err_to_name(err)); }
+
 void set_logging_levels()
 {
     esp_log_level_set("heap_init", ESP_LOG_ERROR);
@@ -154,6 +159,11 @@ void app_main()
         init_nvs();
         init_gpio();
         init_fs();
+        set_enabled_categories(setting::read_int(setting::CATEGORIES));
+        LOAD(initialize_blocklists())
+        LOAD(initialize_ip_blacklist())
+        LOAD(initialize_policy_groups())
+        LOAD(initialize_list_image())
         init_interfaces();
         start_dns();
 
@@ -161,6 +171,7 @@ void app_main()
         initialize_sntp();
         CHECK(start_webserver())
         CHECK(init_ota())
+        CHECK(init_subscriptions())
     } catch(const Err& e){
         ESP_LOGE(TAG, "Error during boot: %s", e.what());
         rollback();
@@ -169,6 +180,7 @@ void app_main()
     cancel_rollback();
     wait_for(ETH_CONNECTED_BIT | WIFI_CONNECTED_BIT, portMAX_DELAY);
     clear_bit(INITIALIZING_BIT);
+    refresh_subscriptions();
     try{
         check_for_update();
     }
@@ -0,0 +1,147 @@
+// Compiles plain, hosts and Adblock lists into a blocklist image for the firmware
+#include "domain_index.h"
+#include "parser.h"
+#include "list_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#define DEFAULT_OUTPUT          "blacklist.img"
+#define DEFAULT_PARTITION_SIZE  (1216*1024)     // blocklist partition in partitions_blocklist.csv
+
+struct compile_stats {
+    image_builder* builder;
+    size_t entries;
+    size_t exceptions;
+    size_t patterns;
+};
+
+static void add_parsed(const char* name, size_t len, uint8_t flags, void* ctx)
+{
+    compile_stats* stats = (compile_stats*)ctx;
+    if( flags & ENTRY_EXCEPTION )
+    {
+        stats->exceptions++;
+        return;
+    }
+    if( strpbrk(name, "*?") != NULL )
+    {
+        stats->patterns++;
+        return;
+    }
+    if( stats->builder->add(name, len, flags) )
+        stats->entries++;
+}
+
+static bool compile_list(const char* path, compile_stats* stats)
+{
+    FILE* list = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if( list == NULL )
+    {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return false;
+    }
+
+    list_parser parser(add_parsed, stats);
+    char buffer[4096];
+    size_t size;
+    while( (size = fread(buffer, 1, sizeof(buffer), list)) > 0 )
+        parser.feed(buffer, size);
+    parser.finish();
+
+    bool ok = !ferror(list);
+    if( list != stdin )
+        fclose(list);
+
+    printf("%s: %zu entries", path, parser.entry_count());
+    if( parser.skipped_count() > 0 )
+        printf(", %zu lines skipped", parser.skipped_count());
+    printf("\n");
+    return ok;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-o output] [-s partition size] list...\n", name);
+}
+
+int main(int argc, char** argv)
+{
+    const char* output = DEFAULT_OUTPUT;
+    size_t partition_size = DEFAULT_PARTITION_SIZE;
+    std::vector<const char*> lists;
+    for( int i = 1; i < argc; i++ )
+    {
+        if( strcmp(argv[i], "-o") == 0 && i + 1 < argc )
+        {
+            output = argv[++i];
+        }
+        else if( strcmp(argv[i], "-s") == 0 && i + 1 < argc )
+        {
+            partition_size = strtoul(argv[++i], NULL, 0);
+        }
+        else if( argv[i][0] == '-' && argv[i][1] != '\0' )
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            lists.push_back(argv[i]);
+        }
+    }
+    if( lists.empty() )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    image_builder builder;
+    compile_stats stats = { &builder, 0, 0, 0 };
+    for( size_t i = 0; i < lists.size(); i++ )
+    {
+        if( !compile_list(lists[i], &stats) )
+            return 1;
+    }
+    if( stats.exceptions > 0 )
+        printf("Skipped %zu exceptions, add them to the allowlist on the device\n", stats.exceptions);
+    if( stats.patterns > 0 )
+        printf("Skipped %zu wildcard entries, add them to blacklist.txt on the device\n", stats.patterns);
+
+    std::vector<uint8_t> image;
+    builder.build(image, time(NULL));
+
+    image_header header;
+    memcpy(&header, image.data(), sizeof(header));
+    if( image.size() > partition_size )
+    {
+        fprintf(stderr, "Image is %zu bytes, partition only holds %zu\n", image.size(), partition_size);
+        return 1;
+    }
+
+    // Read back like the firmware does before writing anything
+    image_reader reader;
+    if( !reader.assign(image.data(), image.size()) )
+    {
+        fprintf(stderr, "Built image failed validation\n");
+        return 1;
+    }
+
+    FILE* out = fopen(output, "wb");
+    if( out == NULL || fwrite(image.data(), 1, image.size(), out) != image.size() )
+    {
+        fprintf(stderr, "Unable to write %s\n", output);
+        if( out != NULL )
+            fclose(out);
+        return 1;
+    }
+    fclose(out);
+
+    printf("Wrote %s: %u entries, %zu bytes (%u byte prefilter), checksum %08X\n", output, header.entries,
+           image.size(), header.filter_blocks*IMAGE_FILTER_BLOCK, header.checksum);
+    return 0;
+}